@@ -0,0 +1,169 @@
+//==============================================================================
+// File: 			    sspiauthz.h
+//
+// Description: 	declaration of our principal table and authorization cache
+//
+//==============================================================================
+// Copyright(C) 2000, Tomas Restrepo. All rights reserved
+// Send comments to: tomasr@mvps.org
+//==============================================================================
+
+#ifndef SSPIAUTHZ_H__INCLUDED
+#define SSPIAUTHZ_H__INCLUDED
+
+#if _MSC_VER > 1000
+#pragma once
+#endif // _MSC_VER > 1000
+
+// forward declaration
+class ServerContext;
+
+/**
+  An interned principal name. There's a single 
+  Principal per name in the process, so they can be
+  compared (and used as keys) by address.
+*/
+class Principal
+{
+public:
+  const wsstring & Name ( ) const;
+  ULONG Id ( ) const;
+
+private:
+  friend class PrincipalTable;
+  Principal ( const wsstring & name, ULONG id );
+
+private:
+  wsstring m_name;
+  ULONG    m_id;
+}; // class Principal
+
+
+/**
+  PrincipalTable interns principal names. Contexts 
+  intern their user name once the handshake completes
+  (see Context::GetPrincipal()), so later code can
+  work with a pointer instead of querying, copying and
+  comparing the name again.
+
+  Principals are never freed: the table grows with
+  the number of distinct users seen by the process.
+  All members are static and thread-safe.
+*/
+class PrincipalTable
+{
+public:
+  static const Principal * Intern ( const wsstring & name );
+  static const Principal * Find ( const wsstring & name );
+  static size_t Size ( );
+
+private:
+  typedef std::map<wsstring, Principal*> ptmap;
+
+private:
+  //! table lock
+  static Winterdom::Runtime::Threading::CriticalSection m_lock;
+  //! interned principals
+  static ptmap m_principals;
+}; // class PrincipalTable
+
+
+/**
+  AuthzEvaluator is the interface AuthzCache uses
+  to make the authorization decisions it doesn't
+  have cached.
+*/
+class AuthzEvaluator
+{
+public:
+  /**
+    Decides whether the client of ctxt may access 
+    resources of class resource_class, usually from its
+    token (see Context::QueryToken()).
+  */
+  virtual bool Evaluate ( ServerContext & ctxt, ULONG resource_class ) =0;
+}; // class AuthzEvaluator
+
+
+/**
+  AuthzCache remembers authorization decisions per 
+  principal and resource class (whatever your 
+  application means by it: a share, a role, an
+  operation...), so repeat logins from the same user 
+  skip the token and group evaluation entirely.
+
+  Decisions, denials included, are kept for at most ttl
+  milliseconds, and the least recently used go first
+  once capacity is reached. Invalidate() drops the
+  decisions for a principal whose groups changed, and
+  keeps Check() calls already evaluating from storing
+  what they decided.
+
+  Everything can be called from any thread.
+*/
+class AuthzCache
+{
+public:
+  AuthzCache ( size_t capacity, DWORD ttl );
+
+  bool Check ( 
+        ServerContext & ctxt, 
+        ULONG resource_class, 
+        AuthzEvaluator & eval 
+      );
+  bool Lookup ( 
+        const Principal * principal, 
+        ULONG resource_class, 
+        bool & allowed 
+      );
+  void Store ( 
+        const Principal * principal, 
+        ULONG resource_class, 
+        bool allowed 
+      );
+  void Invalidate ( const Principal * principal );
+  void Clear ( );
+
+  // == statistics ==
+  size_t Size ( ) const;
+  ULONG Hits ( ) const;
+  ULONG Misses ( ) const;
+
+private:
+  typedef std::pair<const Principal*, ULONG> akey;
+  typedef std::list<akey> alru;
+  //! a cached decision
+  struct decision {
+    bool            allowed;
+    DWORD           stored;
+    alru::iterator  lru;
+  };
+  typedef std::map<akey, decision> acmap;
+
+  ULONG Generation ( ) const;
+  void Store ( 
+        const Principal * principal, 
+        ULONG resource_class, 
+        bool allowed,
+        ULONG generation
+      );
+
+// there's no sane way of copying the cache
+private:
+  AuthzCache ( const AuthzCache & cache );
+  AuthzCache & operator= ( const AuthzCache & cache );
+
+private:
+  size_t   m_capacity;
+  DWORD    m_ttl;
+  acmap    m_decisions;
+  //! most recently used first
+  alru     m_lru;
+  //! bumped by Invalidate() and Clear()
+  ULONG    m_generation;
+  long     m_hits;
+  long     m_misses;
+  mutable Winterdom::Runtime::Threading::CriticalSection m_lock;
+}; // class AuthzCache
+
+#endif // SSPIAUTHZ_H__INCLUDED
@@ -17,6 +17,15 @@
 #pragma once
 #endif // _MSC_VER > 1000
 
+// size of the inline storage held by every Buffer.
+// Allocate() requests up to this size never touch the heap.
+// #define WSSPI_BUFFER_INLINE_SIZE 0 to disable it
+#ifndef WSSPI_BUFFER_INLINE_SIZE
+  #define WSSPI_BUFFER_INLINE_SIZE  64
+#endif
+
+// forward declaration
+class Context;
 
 
 /**
@@ -48,9 +57,26 @@ enum buffer_type {
   bt_mechlist         = SECBUFFER_MECHLIST,  
   bt_ml_signature     = SECBUFFER_MECHLIST_SIGNATURE,  
 
+  bt_token_confirmation = 98,  // a token with our confirmation appended
   bt_confirmation     = 99,  // our own message to signal the client
 };
 
+/**
+  MessageSpan describes a piece of a message
+  that lives in the caller's memory (think iovec or WSABUF).
+  It's used by the scatter-gather overloads of 
+  Context::EncryptMessage() and Context::MakeSignature().
+
+  Writable spans are encrypted in place. Spans marked
+  read_only are integrity protected but left untouched
+  (SECBUFFER_READONLY).
+*/
+struct MessageSpan {
+  BYTE *  data;       // start of the span
+  DWORD   size;       // size of the span, in bytes
+  bool    read_only;  // protect, but don't encrypt
+};
+
 /**
   Buffer represents a communication
   unit between server and client.
@@ -71,6 +97,12 @@ enum buffer_type {
     to reference other memory, so hold your own copy of the pointer
     if you need to free your buffer later.
   </ul>
+
+  Small library owned buffers (up to WSSPI_BUFFER_INLINE_SIZE
+  bytes, such as confirmation messages) are kept inside the
+  Buffer instance itself, so they don't cost a heap allocation.
+  This means the pointer returned by ByteStream() is only valid
+  while the Buffer instance lives.
 */
 class no_vtable Buffer : private SspiBase
 {
@@ -81,6 +113,7 @@ public:
   // == copy ctor/assignment ==
   Buffer ( const Buffer & buf );
   Buffer & operator= ( const Buffer & buf );
+  void Swap ( Buffer & buf );
 
   // == serialization support ==
   void FromByteStream ( const BYTE * stream, DWORD size, buffer_type type );
@@ -101,11 +134,28 @@ public:
   PSecBuffer GetSecBuffer ( );
   void Free ( );
 
+private:
+  void AllocateStorage ( DWORD size );
+  bool IsInline ( ) const;
+  void Account ( );
+  void Unaccount ( );
+
 private:
   //! who owns the buffer memory?
   buffer_owner  m_owner;   
   //! internal SecBuffer struct
   SecBuffer     m_buffer;
+#ifndef WSSPI_NO_BUFFER_STATS
+  //! what we reported to BufferStats (if m_acct_mem != 0)
+  const void *  m_acct_mem;
+  DWORD         m_acct_size;
+  buffer_type   m_acct_type;
+  buffer_owner  m_acct_owner;
+#endif
+#if WSSPI_BUFFER_INLINE_SIZE > 0
+  //! inline storage for small library owned buffers
+  BYTE          m_inline[WSSPI_BUFFER_INLINE_SIZE];
+#endif
 }; // Classs Buffer
 
 
@@ -148,9 +198,11 @@ public:
   Buffer * operator[] ( unsigned index );
   const Buffer * operator[] ( unsigned index ) const;
   size_t size ( ) const;
+  void clear ( );
 
   // == buffer context management ==
   SecBufferDesc * get_bd ( );
+  SecBufferDesc * try_get_bd ( );
   void update ( );
   
 private:
@@ -163,4 +215,93 @@ private:
   bdvector      m_list;
 }; // class BufferDesc
 
+
+
+/**
+  MessageFrame holds a complete protected message in
+  one contiguous allocation: room for the header, the
+  payload (rounded up to the context's BlockSize()) and room
+  for the trailer. It also builds the BufferDesc that
+  Context::EncryptMessage() needs, so you don't have to 
+  allocate and concatenate separate header, data and trailer
+  Buffers yourself.
+
+  The layout depends on the kind of context:
+  <ul>
+  <li> stream contexts (e.g. schannel): 
+    STREAM_HEADER | DATA | STREAM_TRAILER
+  <li> message contexts (e.g. NTLM, Kerberos):
+    TOKEN SIZE | TOKEN | DATA | PADDING
+  </ul>
+  The token goes first, as with the span overload of 
+  Context::EncryptMessage(), and its size travels in front
+  of it as a 32 bit value in network order, so the receiver
+  can tell it from the data. Split() takes such a record
+  apart for Context::DecryptMessage().
+
+  Use it like this:
+  <pre>
+    MessageFrame frame;
+    frame.Prepare ( ctxt, size );
+    memcpy ( frame.Data ( ), payload, size );
+    ctxt.EncryptMessage ( 0, frame );
+    send ( s, frame.WireData ( ), frame.WireSize ( ), 0 );
+  </pre>
+  
+  Once encrypted, the parts are laid out back to back, so
+  the record can be sent as is. The payload itself is
+  never copied; if the provider used less header or trailer
+  room than reserved, only those small pieces get moved.
+*/
+class MessageFrame
+{
+public:
+  MessageFrame ( );
+
+  void Prepare ( const Context & ctxt, DWORD size );
+  BYTE * Data ( );
+  DWORD DataSize ( ) const;
+  void SetDataSize ( DWORD size );
+  DWORD Capacity ( ) const;
+  BufferDesc & Desc ( );
+  void Seal ( );
+  const BYTE * WireData ( ) const;
+  DWORD WireSize ( ) const;
+
+  static bool Split ( BYTE * wire, DWORD size, Buffer & token, Buffer & data );
+
+private:
+  void Layout ( );
+
+// there's no sane way to copy the
+// descriptor, since it references our parts
+private:
+  MessageFrame ( const MessageFrame & frame );
+  MessageFrame & operator= ( const MessageFrame & frame );
+
+private:
+  //! are we framing for a stream context?
+  bool        m_stream;
+  //! bytes reserved before the payload (stream header,
+  //! or token size and token)
+  DWORD       m_header_room;
+  //! payload capacity (multiple of the block size)
+  DWORD       m_capacity;
+  //! bytes reserved after the payload for the stream trailer
+  DWORD       m_trailer_room;
+  //! bytes reserved after the payload for padding
+  DWORD       m_padding_room;
+  //! current payload size
+  DWORD       m_data_size;
+  //! the wire record, once sealed
+  const BYTE* m_wire;
+  DWORD       m_wire_size;
+  //! the single allocation backing all parts
+  Buffer      m_storage;
+  //! header/data/trailer/padding views into m_storage
+  Buffer      m_parts[4];
+  //! descriptor over m_parts
+  BufferDesc  m_desc;
+}; // class MessageFrame
+
 #endif // SSPIBUF_H__INCLUDED
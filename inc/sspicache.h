@@ -0,0 +1,156 @@
+//==============================================================================
+// File: 			    sspicache.h
+//
+// Description: 	declaration of our process-wide credentials cache
+//
+//==============================================================================
+// Copyright(C) 2000, Tomas Restrepo. All rights reserved
+// Send comments to: tomasr@mvps.org
+//==============================================================================
+
+#ifndef SSPICACHE_H__INCLUDED
+#define SSPICACHE_H__INCLUDED
+
+#if _MSC_VER > 1000
+#pragma once
+#endif // _MSC_VER > 1000
+
+/**
+  Describes the NtCredentials you want from the
+  CredentialsCache. Leave user empty for the current
+  logon session, or set has_luid for another one.
+*/
+struct CredentialsSpec
+{
+  CredentialsSpec ( 
+      NtCredentials::NtCredPkg pkg = NtCredentials::nt_negotiate,
+      Credentials::credentials_use use = Credentials::cu_client 
+    );
+
+  NtCredentials::NtCredPkg     pkg;
+  Credentials::credentials_use use;
+  wsstring                     target;
+  //! Negotiate package list (see NtCredentials)
+  wsstring                     packages;
+  bool                         has_luid;
+  LUID                         luid;
+  wsstring                     domain;
+  wsstring                     user;
+  wsstring                     password;
+
+  bool operator< ( const CredentialsSpec & spec ) const;
+};
+
+/**
+  Credentials shared between their owner (say, a 
+  CredentialsCache) and the CredentialsRefs to them
+*/
+struct SharedCredentials
+{
+  Credentials * cred;
+  long          refs;
+  //! somebody is re-acquiring them (see CredentialsCache)
+  bool          refreshing;
+  //! re-acquiring didn't get a later expiry
+  bool          at_limit;
+};
+
+/**
+  CredentialsRef is a counted reference to credentials
+  owned by the CredentialsCache. The credentials stay 
+  alive as long as a reference does, even after the 
+  cache has replaced them with fresh ones, so keep the
+  reference around for as long as a Context uses them.
+  Use Adopt() to share credentials you acquired yourself.
+*/
+class CredentialsRef
+{
+public:
+  CredentialsRef ( );
+  CredentialsRef ( const CredentialsRef & ref );
+  CredentialsRef & operator= ( const CredentialsRef & ref );
+  ~CredentialsRef ( );
+  static CredentialsRef Adopt ( Credentials * cred );
+
+  bool IsValid ( ) const;
+  Credentials & operator* ( ) const;
+  Credentials * operator-> ( ) const;
+
+private:
+  friend class CredentialsCache;
+  explicit CredentialsRef ( SharedCredentials * shared );
+
+private:
+  SharedCredentials * m_shared;
+}; // class CredentialsRef
+
+
+/**
+  CredentialsCache is a process-wide, thread-safe cache
+  of credential handles, so that connections share them
+  instead of each calling AcquireCredentialsHandle().
+
+  Only the first Get() for a given spec acquires the
+  credentials; after that, Get() just hands out another
+  reference until they expire. Then the first Get() 
+  re-acquires them, and the ones that come meanwhile
+  wait for it. Call Refresh() periodically (say, from a 
+  timer or a worker thread) to re-acquire credentials
+  before they expire, so no request ever waits for
+  acquisition once the cache is warm. Connections
+  holding the old credentials keep them until they
+  let go of their reference.
+
+  Credentials are only replaced by ones that expire 
+  later. If re-acquiring doesn't get a later expiry 
+  (say, a Kerberos ticket at its renewal limit), 
+  Refresh() leaves them alone until they expire.
+
+  Note that specs with alternate credentials keep 
+  the password in memory, since Refresh() needs it.
+*/
+class CredentialsCache
+{
+public:
+  static CredentialsCache & Instance ( );
+
+  CredentialsRef Get ( const CredentialsSpec & spec );
+  void SetRefreshLead ( DWORD lead );
+  ULONG Refresh ( );
+  void Clear ( );
+
+  // == statistics ==
+  size_t Size ( ) const;
+  ULONG Hits ( ) const;
+  ULONG Misses ( ) const;
+
+private:
+  typedef std::map<CredentialsSpec, SharedCredentials*> ccmap;
+
+  CredentialsCache ( );
+  static SharedCredentials * Acquire ( const CredentialsSpec & spec );
+  static void Release ( SharedCredentials * shared );
+  SharedCredentials * Renew ( const CredentialsSpec & spec, SharedCredentials * old );
+  friend class CredentialsRef;
+
+// there's no sane way of copying the cache
+private:
+  CredentialsCache ( const CredentialsCache & cache );
+  CredentialsCache & operator= ( const CredentialsCache & cache );
+
+private:
+  ccmap           m_entries;
+  DWORD           m_lead;
+  long            m_hits;
+  long            m_misses;
+  mutable Winterdom::Runtime::Threading::CriticalSection m_lock;
+  //! held while re-acquiring cached credentials
+  Winterdom::Runtime::Threading::CriticalSection m_renew_lock;
+
+  //! singleton lock
+  static Winterdom::Runtime::Threading::CriticalSection m_instance_lock;
+  //! singleton instance
+  static CredentialsCache * m_instance;
+}; // class CredentialsCache
+
+#endif // SSPICACHE_H__INCLUDED
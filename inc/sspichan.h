@@ -0,0 +1,128 @@
+//==============================================================================
+// File: 			    sspichan.h
+//
+// Description: 	declaration of our pool of authenticated client channels
+//
+//==============================================================================
+// Copyright(C) 2000, Tomas Restrepo. All rights reserved
+// Send comments to: tomasr@mvps.org
+//==============================================================================
+
+#ifndef SSPICHAN_H__INCLUDED
+#define SSPICHAN_H__INCLUDED
+
+#if _MSC_VER > 1000
+#pragma once
+#endif // _MSC_VER > 1000
+
+/**
+  A connection to a server, together with the
+  client context authenticated over it
+*/
+struct Channel
+{
+  SOCKET          s;
+  ClientContext * ctxt;
+  //! what the pool knows the channel by
+  wsstring        target;
+  Credentials *   cred;
+  //! when it was last returned to the pool
+  DWORD           idle_since;
+};
+
+
+/**
+  ChannelConnector is the interface ChannelPool
+  uses to open new channels.
+*/
+class ChannelConnector
+{
+public:
+  /**
+    Connects to target, and authenticates ctxt (which
+    already has cred set) over s. Throw SspiEx on
+    failure; the pool cleans up s and ctxt.
+  */
+  virtual void Connect ( 
+          const wsstring & target, Credentials & cred,
+          SOCKET & s, ClientContext & ctxt 
+        ) =0;
+}; // class ChannelConnector
+
+
+/**
+  ChannelPool keeps authenticated client channels
+  around, keyed by target and credentials, so that
+  short lived requests to the same backends can lease
+  an existing channel instead of connecting and
+  authenticating each time.
+
+  Lease() hands out an idle channel after a health
+  check (the context is valid and not about to expire,
+  and the server hasn't closed the connection or sent
+  anything unexpected), or opens a new one through the
+  connector. Return() puts it back, unless it's no 
+  longer usable. Call Evict() periodically to close
+  channels idle for too long.
+
+  At most max_per_target channels exist for each 
+  target and credentials, leased or idle; past that,
+  Lease() returns NULL.
+
+  The credentials must outlive the pool. Everything 
+  can be called from any thread.
+*/
+class ChannelPool
+{
+public:
+  ChannelPool ( 
+        ChannelConnector & connector, 
+        size_t max_per_target = 8, 
+        DWORD max_idle = 60000 
+      );
+  ~ChannelPool ( );
+
+  Channel * Lease ( const wsstring & target, Credentials & cred );
+  void Return ( Channel * ch, bool reusable = true );
+  ULONG Evict ( );
+
+  // == statistics ==
+  size_t Idle ( ) const;
+  ULONG Hits ( ) const;
+  ULONG Misses ( ) const;
+
+  //! channels expiring sooner than this (ms) aren't handed out
+  enum { min_lifetime = 30000 };
+
+private:
+  typedef std::pair<wsstring, Credentials*> ckey;
+  //! channels for a target/credentials pair
+  struct target_pool {
+    std::deque<Channel*> idle;
+    size_t               total;   // idle or leased
+
+    target_pool ( ) : total ( 0 ) { }
+  };
+  typedef std::map<ckey, target_pool> cpmap;
+
+  Channel * Open ( const wsstring & target, Credentials & cred );
+  static bool IsHealthy ( const Channel & ch );
+  static void Close ( Channel * ch );
+  void Forget ( const ckey & key );
+
+// there's no sane way of copying the pool
+private:
+  ChannelPool ( const ChannelPool & pool );
+  ChannelPool & operator= ( const ChannelPool & pool );
+
+private:
+  ChannelConnector & m_connector;
+  size_t             m_max_per_target;
+  DWORD              m_max_idle;
+  cpmap              m_pools;
+  long               m_hits;
+  long               m_misses;
+  mutable Winterdom::Runtime::Threading::CriticalSection m_lock;
+}; // class ChannelPool
+
+#endif // SSPICHAN_H__INCLUDED
@@ -0,0 +1,110 @@
+//==============================================================================
+// File: 			    sspicost.h
+//
+// Description: 	declaration of our per-principal cost tracker
+//
+//==============================================================================
+// Copyright(C) 2000, Tomas Restrepo. All rights reserved
+// Send comments to: tomasr@mvps.org
+//==============================================================================
+
+#ifndef SSPICOST_H__INCLUDED
+#define SSPICOST_H__INCLUDED
+
+#if _MSC_VER > 1000
+#pragma once
+#endif // _MSC_VER > 1000
+
+/**
+  What CostTracker ranks principals by
+*/
+enum cost_metric {
+  ck_time,    // time spent in provider calls
+  ck_legs,    // Authenticate() legs
+  ck_bytes,   // bytes encrypted, decrypted, signed or verified
+};
+
+/**
+  What CostTracker::Top() reports for a principal.
+  cost is an upper bound of the real cost in the ranking
+  metric; cost - error is a lower bound. legs, ticks and
+  bytes only count from the time the principal was last
+  given a slot, so they never overestimate.
+*/
+struct CostEntry {
+  const Principal * principal;  // NULL: not authenticated (yet)
+  ULONGLONG         cost;
+  ULONGLONG         error;
+  ULONG             legs;
+  ULONGLONG         ticks;      // QueryPerformanceCounter() units
+  ULONGLONG         bytes;
+};
+
+/**
+  CostTracker finds the principals that use the most
+  handshake and crypto work, keeping a fixed number of
+  counters (the Space-Saving algorithm): when a principal
+  without one shows up, it takes over the smallest counter,
+  inheriting its count as error. Any principal whose real
+  cost is over total/capacity is guaranteed to be tracked.
+
+  Accounting is optional: nothing is measured until a
+  tracker is installed with Install(). Contexts add up
+  their costs locally and charge them to their principal
+  (Context::GetPrincipal()) every few calls, when the
+  handshake ends and when they're freed. Legs of
+  handshakes that never complete are charged to the NULL
+  principal, so a flood of failed logons shows up too.
+
+  Everything can be called from any thread.
+*/
+class CostTracker
+{
+public:
+  CostTracker ( size_t capacity, cost_metric metric = ck_time );
+  ~CostTracker ( );
+
+  void Charge (
+        const Principal * principal,
+        ULONG legs,
+        ULONGLONG ticks,
+        ULONGLONG bytes
+      );
+  std::vector<CostEntry> Top ( size_t k ) const;
+  void Reset ( );
+
+  // == statistics ==
+  ULONGLONG Total ( ) const;
+  size_t Size ( ) const;
+
+  // == process wide tracker ==
+  static CostTracker * Install ( CostTracker * tracker );
+  static CostTracker * Installed ( );
+
+private:
+  typedef std::vector<CostEntry> cheap;
+  typedef std::map<const Principal*, size_t> cpmap;
+
+  ULONGLONG Measure ( ULONG legs, ULONGLONG ticks, ULONGLONG bytes ) const;
+  void SiftDown ( size_t i );
+
+// there's no sane way of copying the tracker
+private:
+  CostTracker ( const CostTracker & tracker );
+  CostTracker & operator= ( const CostTracker & tracker );
+
+private:
+  size_t        m_capacity;
+  cost_metric   m_metric;
+  //! min-heap of counters, on cost
+  cheap         m_heap;
+  //! where each principal sits in the heap
+  cpmap         m_pos;
+  ULONGLONG     m_total;
+  mutable Winterdom::Runtime::Threading::CriticalSection m_lock;
+
+  //! the tracker contexts charge to
+  static CostTracker * volatile m_installed;
+}; // class CostTracker
+
+#endif // SSPICOST_H__INCLUDED
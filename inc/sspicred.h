@@ -45,6 +45,9 @@ public:
   bool SupportsAlgorithm ( ALG_ID id ) const;
   void GetCipherStrengths ( DWORD & min, DWORD & max ) const;
   DWORD GetProtocols() const;
+  TimeStamp Expiration() const;
+  DWORD TimeToExpiry() const;
+  TokenStats * HandshakeStats ( bool server ) const;
 
 protected:
   // make our constructor protected so that
@@ -69,15 +72,14 @@ protected:
         TKA gkf_argument
     )
   {
-    TimeStamp expiration;
     return g_sspi->AcquireCredentialsHandle ( 
                   principal, 
-                  const_cast<TCHAR*>(Package().Name().c_str()),
+                  const_cast<TCHAR*>(Package().NameStr()),
                   m_use, logon_id, 
                   (void*)auth_data,
                   get_key_func,
                   (void*)gkf_argument,
-                  &m_hCred, &expiration
+                  &m_hCred, &m_expiry
                 );
   }
 
@@ -91,7 +93,10 @@ private:
   credentials_use     m_use;
   SecPkg              m_pkg;
   TCHAR *             m_target;
+  TimeStamp           m_expiry;
   mutable CredHandle  m_hCred;
+  //! our package's TokenStats, client and server side
+  mutable TokenStats * volatile m_tok_stats[2];
 }; // class Credentials
 
 /**
@@ -107,6 +112,11 @@ private:
   You just need to specify the package (NTLM by default)
   and the usual parameters if you need to acquire alternate
   credentials.
+
+  With Negotiate, you can also restrict the packages it
+  may choose from, with a comma separated list, such as
+  _T("Kerberos,!NTLM"). This avoids falling back to the
+  longer NTLM handshake. 
 */
 class NtCredentials : public Credentials
 {
@@ -119,7 +129,8 @@ public:
   NtCredentials (
       NtCredPkg pkg, 
       Credentials::credentials_use use, 
-      const TCHAR * target = NULL 
+      const TCHAR * target = NULL,
+      const TCHAR * packages = NULL
     );
   virtual ~NtCredentials( );
 
@@ -131,6 +142,9 @@ public:
       );
   void AcquireAlternate ( const LUID * luid );
 
+private:
+  SEC_WINNT_AUTH_IDENTITY_EX * AuthIdentity ( );
+
 private:
   SEC_WINNT_AUTH_IDENTITY_EX m_identity;
    
@@ -28,6 +28,47 @@ enum auth_state {
   as_error    =3,   // unknown error (youll never see it)
 };
 
+/**
+  how do we size the output token
+  buffers during authentication?
+*/
+enum token_alloc {
+  ta_max_token =0,  // always use SecPkg::MaxTokenSize()
+  ta_adaptive  =1,  // size from observed tokens (see TokenSizes)
+  ta_provider  =2,  // let the provider allocate it (ISC/ASC_REQ_ALLOCATE_MEMORY)
+};
+
+/**
+  how does the server confirm the 
+  authentication result to the client?
+*/
+enum confirm_mode {
+  cm_round_trip =0, // always with a separate bt_confirmation
+  cm_optimistic =1, // piggybacked, denials reported on first use
+};
+
+/**
+  Counters kept by each Context (see Context::Stats()).
+  Messages and bytes count successful calls only; any 
+  failed provider call counts in failures. Times are in 
+  QueryPerformanceCounter() units.
+*/
+struct ContextStats {
+  ULONG     msgs_encrypted;
+  ULONG     msgs_decrypted;
+  ULONG     msgs_signed;
+  ULONG     msgs_verified;
+  ULONGLONG bytes_encrypted;
+  ULONGLONG bytes_decrypted;
+  ULONGLONG bytes_signed;
+  ULONGLONG bytes_verified;
+  ULONG     failures;
+  ULONGLONG provider_ticks;   // in provider calls
+  ULONG     legs;             // Authenticate() legs
+  ULONG     handshakes;       // completed, denied or failed
+  ULONGLONG handshake_ticks;  // from first to last leg
+};
+
 /**
   Context is the base class for our server 
   and client classes. It wraps all the 
@@ -42,8 +83,13 @@ public:
   void SetCredentials ( Credentials & cred );
 
   bool IsValid ( ) const;
+  ULONG Serial ( ) const;
   PCtxtHandle GetHandle ( );
   void SetWorkingParams ( ULONG ctxt_reqs, ULONG data_rep );
+  void SetTokenAllocation ( token_alloc mode );
+  void SetConfirmMode ( confirm_mode mode );
+  virtual bool IsServer ( ) const =0;
+  ULONG Legs ( ) const;
   void Free ( );
 
   // == query attributes wrappers
@@ -57,6 +103,7 @@ public:
   ULONG StreamNumBuffers ( ) const;
   //    SecPkgContext_Names
   wsstring UserName ( ) const;
+  const Principal * GetPrincipal ( ) const;
   wsstring AuthorityName ( ) const;
   //    SecPkgContext_KeyInfo
   wsstring SignatureAlgName ( ) const;
@@ -65,25 +112,60 @@ public:
   ALG_ID SignatureAlgorithm ( ) const;
   ALG_ID EncryptAlgorithm ( ) const;
   void GetLifeSpan ( TimeStamp & start, TimeStamp & expiration ) const;
+  //    negotiated by Initialize/AcceptSecurityContext
+  ULONG ContextAttributes ( ) const;
+  bool HasConfidentiality ( ) const;
+  bool HasIntegrity ( ) const;
+  bool HasReplayDetect ( ) const;
+  bool HasSequenceDetect ( ) const;
+  TimeStamp Expiration ( ) const;
+  DWORD TimeToExpiry ( ) const;
   
   // == message security ==
   void EncryptMessage ( ULONG qop, BufferDesc & msg, ULONG seq_num = 0 );
+  void EncryptMessage ( ULONG qop, MessageFrame & frame, ULONG seq_num = 0 );
+  void EncryptMessage ( 
+        ULONG qop, const MessageSpan * spans, size_t count,
+        Buffer & header, Buffer & trailer, ULONG seq_num = 0 
+      );
   void DecryptMessage ( ULONG & qop, BufferDesc & msg, ULONG seq_num = 0 );
 
   // == signature support ==
   void MakeSignature ( ULONG qop, BufferDesc & msg, ULONG seq_num = 0 );
+  void MakeSignature ( 
+        ULONG qop, const MessageSpan * spans, size_t count,
+        Buffer & signature, ULONG seq_num = 0 
+      );
   void VerifySignature ( ULONG & qop, BufferDesc & msg, ULONG seq_num = 0 );
+  void VerifySignature ( 
+        ULONG & qop, const MessageSpan * spans, size_t count,
+        Buffer & signature, ULONG seq_num = 0 
+      );
+
+  // == status returning versions of the above ==
+  SECURITY_STATUS TryEncryptMessage ( ULONG qop, BufferDesc & msg, ULONG seq_num = 0 ) throw();
+  SECURITY_STATUS TryEncryptMessage ( ULONG qop, MessageFrame & frame, ULONG seq_num = 0 ) throw();
+  SECURITY_STATUS TryDecryptMessage ( ULONG & qop, BufferDesc & msg, ULONG seq_num = 0 ) throw();
+  SECURITY_STATUS TryMakeSignature ( ULONG qop, BufferDesc & msg, ULONG seq_num = 0 ) throw();
+  SECURITY_STATUS TryVerifySignature ( ULONG & qop, BufferDesc & msg, ULONG seq_num = 0 ) throw();
 
   // == importing/exporting security contexts ==
-  void Import ( Buffer & ctxt );
-  void Export ( Buffer & ctxt );
+  void Import ( Buffer & ctxt, HANDLE token = NULL );
+  void Export ( Buffer & ctxt, HANDLE * token = 0 );
 
   // == token stuff ==
   void ApplyControlToken ( Buffer & token );
   HANDLE QueryToken ( );
+  HANDLE Token ( );
+
+  // == statistics ==
+  ContextStats Stats ( ) const;
+  void ResetStats ( );
 
   // == authentication ==
   auth_state Authenticate ( Buffer * in, Buffer * out );
+  SECURITY_STATUS TryAuthenticate ( Buffer * in, Buffer * out, auth_state & state ) throw();
+  void Renegotiate ( );
 
 protected:
     Context ( );
@@ -105,13 +187,69 @@ private:
           PCtxtHandle new_ctxt, PSecBufferDesc obd
         ) =0;
 
+  //! SecPkgContext_KeyInfo, with our own copies of the names
+  struct key_info {
+    ULONG     key_size;
+    ALG_ID    sig_alg;
+    ALG_ID    enc_alg;
+    wsstring  sig_alg_name;
+    wsstring  enc_alg_name;
+  };
+  //! attributes captured once the context is established
+  struct attr_cache {
+    SecPkgContext_Sizes       sizes;
+    SecPkgContext_StreamSizes stream_sizes;
+    key_info                  key;
+    wsstring                  user_name;
+    TimeStamp                 start;
+    TimeStamp                 expiry;
+  };
+  //! work not yet charged to the CostTracker
+  struct cost_acc {
+    ULONG     calls;
+    ULONG     legs;
+    ULONGLONG ticks;
+    ULONGLONG bytes;
+  };
+
+  const SecPkgContext_Sizes & Sizes ( SecPkgContext_Sizes & tmp ) const;
+  const SecPkgContext_StreamSizes & 
+    StreamSizes ( SecPkgContext_StreamSizes & tmp ) const;
+  const key_info & KeyInfo ( key_info & tmp ) const;
+  SECURITY_STATUS AuthenticateLeg ( Buffer * in, Buffer * out, auth_state & state );
+  void CacheAttributes ( );
+  void PiggybackConfirmation ( Buffer & token );
+  SECURITY_STATUS CheckConfirmation ( BufferDesc & msg );
+  //! provider calls we keep counters for
+  enum stat_op { so_encrypt, so_decrypt, so_sign, so_verify, so_leg };
+  static ULONGLONG Clock ( );
+  void Account ( 
+        stat_op op, ULONGLONG start, 
+        SECURITY_STATUS status, PSecBufferDesc bd 
+      );
+  void ChargeCost ( );
+
 protected:
           ULONG         m_ctxt_reqs;
           ULONG         m_data_rep;
           Credentials * m_cred;
           auth_state    m_state;
+          token_alloc   m_token_alloc;
+          confirm_mode  m_confirm_mode;
+          ULONG         m_ctxt_attr;
+          TimeStamp     m_expiry;
 private:
+          ULONG         m_leg;
+          ULONG         m_serial;
           bool          m_have_ctxt;
+          bool          m_have_attrs;
+          attr_cache    m_attrs;
+  const   Principal *   m_principal;
+          HANDLE        m_token;
+          cost_acc      m_cost;
+          ContextStats  m_stats;
+          ULONGLONG     m_hs_start;
+  mutable volatile LONG m_stats_seq;
   mutable CtxtHandle    m_hCtxt;
 }; // class Context
 
@@ -125,6 +263,9 @@ private:
 */
 class ClientContext : public Context
 {
+public:
+  virtual bool IsServer ( ) const;
+
 private:
   virtual SECURITY_STATUS CreateContext ( 
               PCtxtHandle old_ctxt, PSecBufferDesc ibd,
@@ -149,12 +290,16 @@ private:
             );
 
 public:
+  virtual bool IsServer ( ) const;
+
   // login confirmation
   void ConfirmAuthentication ( Buffer & buf );
 
   // == impersonation support ==
   void ImpersonateClient ( );
   void RevertToSelf ( );
+  SECURITY_STATUS TryImpersonateClient ( ) throw();
+  SECURITY_STATUS TryRevertToSelf ( ) throw();
 }; // class ServerContext
 
 #endif // SSPICTXT_H__INCLUDED
@@ -0,0 +1,178 @@
+//==============================================================================
+// File: 			    sspidrv.h
+//
+// Description: 	declaration of our asynchronous handshake driver
+//
+//==============================================================================
+// Copyright(C) 2000, Tomas Restrepo. All rights reserved
+// Send comments to: tomasr@mvps.org
+//==============================================================================
+
+#ifndef SSPIDRV_H__INCLUDED
+#define SSPIDRV_H__INCLUDED
+
+#if _MSC_VER > 1000
+#pragma once
+#endif // _MSC_VER > 1000
+
+/**
+  HandshakeHandler is the interface HandshakeDriver 
+  uses to tell you a handshake is over.
+*/
+class HandshakeHandler
+{
+public:
+  /**
+    Called once per handshake added to the driver. 
+    state is as_ok or as_denied if the handshake ran to
+    completion, or as_error if it failed (error is then
+    a Win32 or SSPI error code, ERROR_TIMEOUT if the peer
+    was too slow). On as_error, the context has already
+    been released with Context::Free().
+
+    The socket and the context are yours again.
+  */
+  virtual void OnHandshakeDone ( 
+          SOCKET s, Context * ctxt, 
+          auth_state state, DWORD error 
+        ) =0;
+  /**
+    Called once per HandshakeDriver::Send(), after the
+    encrypted message went out (error is 0) or failed.
+    The socket and the context are yours again.
+  */
+  virtual void OnSendDone ( SOCKET s, Context * ctxt, DWORD error ) { }
+}; // class HandshakeHandler
+
+
+/**
+  HandshakeDriver runs many handshakes at once over
+  overlapped sockets and a single I/O completion port, 
+  without a thread per connection.
+
+  Tokens are exchanged as frames with an 8 byte header:
+  the buffer type and the data size, both 32 bits in
+  network byte order, followed by the data. The driver runs
+  all the legs, sends the confirmation (see 
+  ServerContext::ConfirmAuthentication()) and enforces a 
+  timeout per leg. Client contexts start by sending their
+  first token, server contexts by waiting for one.
+
+  The provider calls themselves (Authenticate(), 
+  EncryptMessage()) run on the Executor set with 
+  SetExecutor(); by default, they run inline on the
+  loop thread. With a PoolExecutor, the loop thread 
+  only does I/O, and a slow provider call (say, a KDC 
+  round trip) doesn't hold up the other connections.
+  The result comes back through the completion port,
+  so the continuation always runs on the loop thread.
+
+  Add(), Send() and Run() must be called from the same 
+  thread (the one driving the loop); the handler is
+  called from it too. Stop() can be called from any thread.
+
+  Note that the sockets must have been created for 
+  overlapped I/O (WSASocket() with WSA_FLAG_OVERLAPPED, 
+  or socket()), and can't have been associated with 
+  another completion port. Call Forget() before closing
+  a socket you added, so a new socket that gets the same
+  handle is associated again.
+*/
+class HandshakeDriver
+{
+public:
+  HandshakeDriver ( HandshakeHandler & handler, DWORD leg_timeout = 30000 );
+  ~HandshakeDriver ( );
+
+  void SetExecutor ( Executor * exec );
+  void Add ( SOCKET s, Context * ctxt );
+  void Forget ( SOCKET s );
+  void Send ( SOCKET s, Context * ctxt, const void * data, DWORD size );
+  bool Run ( DWORD timeout );
+  void Stop ( );
+  size_t Pending ( ) const;
+
+  //! largest token frame we accept
+  enum { max_frame = 0x10000 };
+
+private:
+  //! where is a connection in the exchange?
+  enum conn_phase {
+    cp_read_header,
+    cp_read_body,
+    cp_write,
+    cp_leg,
+  };
+  struct conn;
+  typedef std::list<conn*> ctlist;
+  /**
+    Runs the provider call for a connection on
+    the executor, and posts the result back
+  */
+  struct leg_task : public Task {
+    HandshakeDriver * drv;
+    conn *            c;
+    void Run ( );
+    bool DataPlane ( ) const;
+  };
+  friend struct leg_task;
+  /**
+    A handshake in progress. The OVERLAPPED must come
+    first: we get it back from the completion port.
+  */
+  struct conn {
+    OVERLAPPED        ov;
+    SOCKET            s;
+    Context *         ctxt;
+    conn_phase        phase;
+    BYTE              header[8];
+    DWORD             done;
+    Buffer            in;
+    std::vector<BYTE> out;
+    MessageFrame      frame;
+    const BYTE *      wire;
+    DWORD             wire_size;
+    bool              finished;
+    bool              timed_out;
+    bool              sending;
+    auth_state        state;
+    DWORD             error;
+    leg_task          task;
+    DWORD             started;
+    ctlist::iterator  timer;
+  };
+
+  conn * NewConn ( SOCKET s, Context * ctxt );
+  void Step ( conn * c );
+  void RunLeg ( conn * c );
+  void AfterLeg ( conn * c );
+  void OnCompletion ( conn * c, DWORD error, DWORD bytes );
+  void StartRead ( conn * c );
+  void StartWrite ( conn * c );
+  void Queue ( conn * c, buffer_type type, const BYTE * data, DWORD size );
+  void QueueHeader ( conn * c, buffer_type type, DWORD size );
+  static DWORD WriteSize ( const conn * c );
+  void Finish ( conn * c, auth_state state, DWORD error );
+  void ResetTimer ( conn * c );
+  void ExpireTimers ( );
+  DWORD NextTimer ( ) const;
+
+// there's no sane way of copying the driver
+private:
+  HandshakeDriver ( const HandshakeDriver & drv );
+  HandshakeDriver & operator= ( const HandshakeDriver & drv );
+
+private:
+  HandshakeHandler & m_handler;
+  DWORD              m_leg_timeout;
+  HANDLE             m_port;
+  Executor *         m_exec;
+  //! connections by start of their current leg
+  ctlist             m_timers;
+  //! all live connections
+  std::set<conn*>    m_conns;
+  //! sockets associated with m_port
+  std::set<SOCKET>   m_sockets;
+}; // class HandshakeDriver
+
+#endif // SSPIDRV_H__INCLUDED
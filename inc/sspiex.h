@@ -22,7 +22,18 @@
 // default is throw by value
 // #define WSSPI_EX_THROW_NEW
 // to throw them using new
-#ifndef WSSPI_EX_THROW_NEW
+// #define WSSPI_NO_EXCEPTIONS
+// to build without exceptions (say, without /EHsc):
+// errors go to SspiEx::Fail(), so use the Try* 
+// methods for anything that can fail
+
+#if defined(WSSPI_NO_EXCEPTIONS)
+  #ifdef WSSPI_EX_THROW_NEW
+    #error WSSPI_EX_THROW_NEW needs exceptions
+  #endif
+  #define throwex(x)    (SspiEx::Fail(SspiEx(x)))
+  #define throwexe(x,y) (SspiEx::Fail(SspiEx(x,y)))
+#elif !defined(WSSPI_EX_THROW_NEW)
   #define throwex(x)    (throw SspiEx(x))
   #define throwexe(x,y) (throw SspiEx(x,y))
 #else
@@ -52,6 +63,7 @@ enum sspi_error {
   err_export_failed,       // failed to export security context
   err_act_failed,          // ApplyControlToken() failed
   err_query_token_failed,  // QuerySecurityContextToken() failed
+  err_io_failed,           // socket or completion port failure
   err_unknown,             // unknown error
 };
 
@@ -72,6 +84,11 @@ public:
   wsstring ErrorString ( ) const;
   wsstring Win32ErrString ( ) const;
 
+  // == WSSPI_NO_EXCEPTIONS support ==
+  typedef void (*fail_handler) ( const SspiEx & e );
+  static fail_handler SetFailHandler ( fail_handler handler );
+  static __declspec(noreturn) void Fail ( const SspiEx & e );
+
 private:
   //! library error code
   sspi_error  m_err;
@@ -0,0 +1,77 @@
+//==============================================================================
+// File: 			    sspiexec.h
+//
+// Description: 	declaration of the executors used to run provider calls
+//
+//==============================================================================
+// Copyright(C) 2000, Tomas Restrepo. All rights reserved
+// Send comments to: tomasr@mvps.org
+//==============================================================================
+
+#ifndef SSPIEXEC_H__INCLUDED
+#define SSPIEXEC_H__INCLUDED
+
+#if _MSC_VER > 1000
+#pragma once
+#endif // _MSC_VER > 1000
+
+/**
+  A unit of work handed to an Executor. The
+  executor doesn't own it; whoever posts it
+  must keep it alive until Run() returns.
+*/
+class Task
+{
+public:
+  virtual ~Task ( ) { }
+  virtual void Run ( ) =0;
+  /**
+    Does this task work on an established session,
+    rather than on a handshake? Executors that
+    prioritize (see HandshakeScheduler) look at it.
+  */
+  virtual bool DataPlane ( ) const { return false; }
+}; // class Task
+
+
+/**
+  Executor decides where Task::Run() gets called.
+  Implement it to hook the library into your
+  own thread pool.
+*/
+class Executor
+{
+public:
+  virtual ~Executor ( ) { }
+  virtual void Post ( Task * task ) =0;
+}; // class Executor
+
+
+/**
+  Runs tasks right away, on the posting thread
+*/
+class InlineExecutor : public Executor
+{
+public:
+  void Post ( Task * task );
+}; // class InlineExecutor
+
+
+/**
+  Runs tasks on the system thread pool,
+  through QueueUserWorkItem()
+*/
+class PoolExecutor : public Executor
+{
+public:
+  PoolExecutor ( bool long_running = false );
+  void Post ( Task * task );
+
+private:
+  static DWORD WINAPI Thunk ( LPVOID param );
+
+private:
+  ULONG m_flags;
+}; // class PoolExecutor
+
+#endif // SSPIEXEC_H__INCLUDED
@@ -0,0 +1,69 @@
+//==============================================================================
+// File: 			    sspihand.h
+//
+// Description: 	declaration of our context handoff between processes
+//
+//==============================================================================
+// Copyright(C) 2000, Tomas Restrepo. All rights reserved
+// Send comments to: tomasr@mvps.org
+//==============================================================================
+
+#ifndef SSPIHAND_H__INCLUDED
+#define SSPIHAND_H__INCLUDED
+
+#if _MSC_VER > 1000
+#pragma once
+#endif // _MSC_VER > 1000
+
+/**
+  ContextHandoff moves an established connection, the
+  socket and its security context, from one process to 
+  another, for servers where an acceptor process 
+  authenticates clients and worker processes serve them.
+
+  The acceptor calls Send() with a duplex pipe to the 
+  worker (a named pipe, say): the context is exported
+  with Context::Export(), the socket duplicated for the
+  worker with WSADuplicateSocket(), and both written to
+  the pipe. The worker calls Receive(), which recreates 
+  the socket and imports the context; message sequence
+  numbers carry over, so the worker just goes on with 
+  EncryptMessage()/DecryptMessage() where the acceptor
+  left off. For server contexts, the client's token is
+  duplicated into the worker too, so it can impersonate.
+  Receive() acknowledges the handoff, and only
+  then does Send() release the acceptor's socket and
+  context; if the worker failed, Send() throws and the 
+  acceptor still owns both.
+
+  Since the context can't be used on both sides at once,
+  don't touch it in the acceptor while Send() runs.
+*/
+class ContextHandoff
+{
+public:
+  static void Send ( HANDLE pipe, DWORD worker_pid, SOCKET s, Context & ctxt );
+  static SOCKET Receive ( HANDLE pipe, Context & ctxt );
+
+  //! largest exported context we accept
+  enum { max_blob = 0x10000 };
+
+private:
+  //! what goes over the pipe first
+  struct header {
+    DWORD magic;
+    DWORD version;
+    DWORD blob_size;
+    DWORD token;      // handle in the worker, or 0
+  };
+
+  static void Write ( HANDLE pipe, const void * data, DWORD size );
+  static void Read ( HANDLE pipe, void * data, DWORD size );
+  static void Acknowledge ( HANDLE pipe, DWORD error );
+  static HANDLE ShareToken ( HANDLE process, Context & ctxt, Buffer & blob );
+
+private:
+  ContextHandoff ( );
+}; // class ContextHandoff
+
+#endif // SSPIHAND_H__INCLUDED
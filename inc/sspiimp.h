@@ -0,0 +1,81 @@
+//==============================================================================
+// File: 			    sspiimp.h
+//
+// Description: 	declaration of our scoped impersonation guard
+//
+//==============================================================================
+// Copyright(C) 2000, Tomas Restrepo. All rights reserved
+// Send comments to: tomasr@mvps.org
+//==============================================================================
+
+#ifndef SSPIIMP_H__INCLUDED
+#define SSPIIMP_H__INCLUDED
+
+#if _MSC_VER > 1000
+#pragma once
+#endif // _MSC_VER > 1000
+
+/**
+  ImpersonationScope impersonates the client of a 
+  ServerContext for as long as it lives, and puts the
+  thread back the way it found it afterwards (nested
+  scopes restore the outer impersonation).
+
+  The scope remembers which context each thread is 
+  impersonating (by its Context::Serial(), so a new 
+  context at a freed one's address isn't mistaken for
+  it), and skips the provider call when it's already
+  the right one. With lazy set, it doesn't
+  revert on the way out either, so a thread serving
+  consecutive requests for the same context switches
+  only once. Call RevertThread() when the thread is done
+  with the context (before it goes back to a pool, and 
+  always before another thread frees the context; 
+  Context::Free() only reverts the calling thread).
+
+  ServerContext::ImpersonateClient() and RevertToSelf()
+  keep the record up to date, so they can be mixed
+  with scopes.
+*/
+class ImpersonationScope
+{
+public:
+  ImpersonationScope ( ServerContext & ctxt, bool lazy = false );
+  ~ImpersonationScope ( );
+
+  static void RevertThread ( );
+  static ServerContext * Current ( );
+
+  // == statistics ==
+  static ULONG Switches ( );
+  static ULONG Avoided ( );
+
+private:
+  friend class Context;
+  friend class ServerContext;
+  static void SetCurrent ( ServerContext * ctxt );
+  static bool IsCurrent ( const ServerContext * ctxt );
+  static DWORD Slot ( volatile LONG & slot, bool alloc );
+
+// a scope belongs to its block
+private:
+  ImpersonationScope ( const ImpersonationScope & scope );
+  ImpersonationScope & operator= ( const ImpersonationScope & scope );
+
+private:
+  ServerContext * m_ctxt;
+  ServerContext * m_previous;
+  bool            m_lazy;
+  bool            m_switched;
+
+  //! TLS slots holding the impersonated context and its
+  //! serial, allocated on first use
+  static volatile LONG m_tls_ctxt;
+  static volatile LONG m_tls_serial;
+  //! impersonations and reverts done
+  static long     m_switches;
+  //! impersonations and reverts skipped
+  static long     m_avoided;
+}; // class ImpersonationScope
+
+#endif // SSPIIMP_H__INCLUDED
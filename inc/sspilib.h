@@ -112,6 +112,8 @@ public:
   {
     g_sspi.Release ( );
   }
+protected:
+  static DWORD TimeLeft ( const TimeStamp & ts );
 protected:
   //! library reference
   SspiLib & g_sspi;
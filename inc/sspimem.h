@@ -0,0 +1,128 @@
+//==============================================================================
+// File: 			    sspimem.h
+//
+// Description: 	declaration of our buffer memory accounting class
+//
+//==============================================================================
+// Copyright(C) 2000, Tomas Restrepo. All rights reserved
+// Send comments to: tomasr@mvps.org
+//==============================================================================
+
+#ifndef SSPIMEM_H__INCLUDED
+#define SSPIMEM_H__INCLUDED
+
+#if _MSC_VER > 1000
+#pragma once
+#endif // _MSC_VER > 1000
+
+// buffer accounting is on by default.
+// #define WSSPI_NO_BUFFER_STATS to compile it out
+
+/**
+  Number of live buffers and the bytes they hold
+*/
+struct BufferUsage {
+  long     count;
+  LONGLONG bytes;
+};
+
+/**
+  A point in time copy of the buffer accounting
+  maintained by BufferStats.
+*/
+class BufferSnapshot
+{
+public:
+  enum { 
+    num_owners = 3,  // bo_sspi, bo_user, bo_lib
+    num_types  = 15, // SECBUFFER_ types, bt_confirmation, other
+  };
+
+  BufferSnapshot ( );
+
+  const BufferUsage & ByOwner ( buffer_owner owner ) const;
+  const BufferUsage & ByType ( buffer_type type ) const;
+
+  static int TypeIndex ( buffer_type type );
+
+private:
+  friend class BufferStats;
+  friend wsostream & operator<< ( wsostream & o, const BufferSnapshot & s );
+  BufferUsage m_owner[num_owners];
+  BufferUsage m_type[num_types];
+}; // class BufferSnapshot
+
+/**
+  BufferStats keeps track of the memory held by live
+  Buffer instances, per buffer_owner and per buffer_type.
+  Counters are updated with interlocked operations, so 
+  there's no locking on the Buffer allocation path.
+
+  Buffers owned by the provider (bo_sspi), such as
+  those returned by Context::Export() or provider 
+  allocated tokens, must be released with
+  FreeContextBuffer(). Those are also registered 
+  individually, so that the ones still alive can be listed
+  by ReportSspi(), and at process exit, to the debugger
+  (via OutputDebugString()).
+
+  Memory is accounted when it is attached to a Buffer
+  (Allocate(), FromByteStream(), SetOwner(), copies), with
+  the size and type it had at that moment. Only memory
+  the library (bo_lib) or the provider (bo_sspi) owns is
+  counted, on purpose: user owned (bo_user) buffers only
+  point to memory somebody else holds and frees, so
+  counting it would report memory we can't leak.
+  ByOwner(bo_user) is always zero, and ByType() covers
+  bo_lib and bo_sspi buffers only.
+
+  Everything is set up on first use, so Buffers can
+  be created and destroyed by other static objects.
+*/
+class BufferStats
+{
+public:
+  static void Snapshot ( BufferSnapshot & snap );
+  static size_t ReportSspi ( wsostream & o );
+  static void SetExitReport ( bool enable );
+
+  // == used by Buffer ==
+  static void Add ( 
+        buffer_owner owner, buffer_type type, 
+        DWORD size, const void * mem 
+      );
+  static void Remove ( 
+        buffer_owner owner, buffer_type type, 
+        DWORD size, const void * mem 
+      );
+
+private:
+  //! a live provider owned buffer
+  struct sspi_buf {
+    buffer_type type;
+    DWORD       size;
+  };
+  typedef std::map<const void*, sspi_buf> sbmap;
+  //! live bo_sspi buffers, and their lock
+  struct sspi_registry {
+    Winterdom::Runtime::Threading::CriticalSection lock;
+    sbmap                                          buffers;
+  };
+
+  static sspi_registry & Registry ( );
+  static void ExitReport ( );
+  friend class BufferStatsReporter;
+
+private:
+  // plain data, so it's there before any constructor runs
+  static volatile long     m_count[BufferSnapshot::num_owners][BufferSnapshot::num_types];
+  static volatile LONGLONG m_bytes[BufferSnapshot::num_owners][BufferSnapshot::num_types];
+  //! report live bo_sspi buffers at exit?
+  static bool m_exit_report;
+  //! created on first use, and never deleted
+  static sspi_registry * volatile m_registry;
+}; // class BufferStats
+
+wsostream & operator<< ( wsostream & o, const BufferSnapshot & s );
+
+#endif // SSPIMEM_H__INCLUDED
@@ -41,6 +41,7 @@ public:
   USHORT RpcId ( ) const;
   ULONG MaxTokenSize ( ) const;
   wsstring Name ( ) const;
+  const TCHAR * NameStr ( ) const;
   wsstring Comment ( ) const;
   bool IsValid ( ) const;
   // == operators ==
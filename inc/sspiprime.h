@@ -0,0 +1,102 @@
+//==============================================================================
+// File: 			    sspiprime.h
+//
+// Description: 	declaration of our pool of primed client contexts
+//
+//==============================================================================
+// Copyright(C) 2000, Tomas Restrepo. All rights reserved
+// Send comments to: tomasr@mvps.org
+//==============================================================================
+
+#ifndef SSPIPRIME_H__INCLUDED
+#define SSPIPRIME_H__INCLUDED
+
+#if _MSC_VER > 1000
+#pragma once
+#endif // _MSC_VER > 1000
+
+/**
+  ClientTokenPool keeps a number of ClientContexts that
+  have already gone through their first authentication leg
+  for a given Credentials/Target pair, together with the
+  token that leg produced.
+
+  The first InitializeSecurityContext() call is pure client
+  side work (and for Kerberos, possibly a trip to the KDC),
+  so doing it ahead of time lets a new connection send its
+  first token right away, in the same flight as the connect.
+
+  Call Fill() periodically (say, from a timer or a worker
+  thread) to top up the pool and drop entries older than
+  the maximum age; tokens carry timestamps, so they can't
+  be kept around forever. Acquire() hands out a primed 
+  context, or primes one on the spot if the pool is empty.
+
+  The credentials must outlive the pool. Everything can
+  be called from any thread: concurrent Fill() calls 
+  never prime more than depth contexts between them, and
+  contexts primed before a configuration change or a
+  Clear() are discarded instead of pooled.
+*/
+class ClientTokenPool
+{
+public:
+  ClientTokenPool ( 
+        Credentials & cred, 
+        size_t depth, 
+        DWORD max_age = 60000 
+      );
+  ~ClientTokenPool ( );
+
+  // == configuration of the contexts we create ==
+  void SetWorkingParams ( ULONG ctxt_reqs, ULONG data_rep );
+  void SetConfirmMode ( confirm_mode mode );
+
+  // == pool management ==
+  void Fill ( );
+  ClientContext * Acquire ( Buffer & token );
+  void Clear ( );
+
+  // == statistics ==
+  size_t Size ( ) const;
+  ULONG Hits ( ) const;
+  ULONG Misses ( ) const;
+
+private:
+  //! a primed context and its first token
+  struct entry {
+    ClientContext * ctxt;
+    Buffer *        token;
+    DWORD           created;
+    ULONG           generation; // of the settings it used
+  };
+  typedef std::deque<entry> pdeque;
+
+  entry Prime ( );
+  static void Release ( entry & e );
+  bool IsExpired ( const entry & e, DWORD now ) const;
+
+// there's no sane way of copying the pool
+private:
+  ClientTokenPool ( const ClientTokenPool & pool );
+  ClientTokenPool & operator= ( const ClientTokenPool & pool );
+
+private:
+  Credentials &   m_cred;
+  size_t          m_depth;
+  DWORD           m_max_age;
+  ULONG           m_ctxt_reqs;
+  ULONG           m_data_rep;
+  bool            m_have_params;
+  confirm_mode    m_confirm_mode;
+  long            m_hits;
+  long            m_misses;
+  pdeque          m_entries;
+  //! bumped when pooled entries become unwanted
+  ULONG           m_generation;
+  //! slots reserved by Fill() calls still priming
+  size_t          m_pending;
+  mutable Winterdom::Runtime::Threading::CriticalSection m_lock;
+}; // class ClientTokenPool
+
+#endif // SSPIPRIME_H__INCLUDED
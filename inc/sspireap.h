@@ -0,0 +1,117 @@
+//==============================================================================
+// File: 			    sspireap.h
+//
+// Description: 	declaration of our half-open handshake reaper
+//
+//==============================================================================
+// Copyright(C) 2000, Tomas Restrepo. All rights reserved
+// Send comments to: tomasr@mvps.org
+//==============================================================================
+
+#ifndef SSPIREAP_H__INCLUDED
+#define SSPIREAP_H__INCLUDED
+
+#if _MSC_VER > 1000
+#pragma once
+#endif // _MSC_VER > 1000
+
+/**
+  HandshakeReaper keeps track of handshakes in progress
+  (contexts still in as_continue) and releases the ones 
+  whose peer went quiet, so abandoned clients can't pin
+  provider contexts and token buffers forever. It also
+  caps the number of handshakes in flight and the token
+  bytes they hold.
+
+  Deadlines live in a hashed timer wheel spanning one
+  leg timeout, so arming, disarming and expiring a
+  handshake are all O(1), and Tick() only looks at the
+  slots that came due since the last call. Expiry is
+  decided on elapsed time (now - start), never on 
+  absolute tick counts, so GetTickCount() wrapping 
+  around doesn't matter.
+
+  Usage, for each handshake:
+  <ul>
+    <li>Register() it before the first leg. A NULL handle
+      means a cap was hit: turn the peer away.
+    <li>Call Begin() before each Authenticate() call, and
+      End() after it, with the bytes you now hold for it
+      (tokens received or waiting to be sent). While 
+      between Begin() and End(), the handshake is never 
+      reaped. If Begin() returns false, the handshake 
+      expired and its context was already Free()d.
+    <li>Unregister() it when it's done, successful or not.
+  </ul>
+  Call Tick() periodically (every tick milliseconds or
+  so) to reap expired handshakes with Context::Free().
+
+  Everything can be called from any thread.
+*/
+class HandshakeReaper
+{
+public:
+  struct entry;
+  typedef entry * handle;
+
+  HandshakeReaper ( 
+        DWORD leg_timeout, 
+        ULONG max_handshakes, 
+        ULONG max_bytes, 
+        DWORD tick = 100 
+      );
+  ~HandshakeReaper ( );
+
+  handle Register ( Context * ctxt, ULONG bytes = 0 );
+  bool Begin ( handle h );
+  void End ( handle h, ULONG bytes );
+  void Unregister ( handle h );
+  ULONG Tick ( );
+
+  // == statistics ==
+  ULONG InFlight ( ) const;
+  ULONG Bytes ( ) const;
+  ULONG Reaped ( ) const;
+
+  /**
+    A tracked handshake. The links make it
+    a member of a wheel slot.
+  */
+  struct entry {
+    Context * ctxt;
+    ULONG     bytes;
+    DWORD     start;      // GetTickCount() when armed
+    DWORD     timeout;    // ms from start
+    size_t    slot;
+    bool      armed;
+    bool      reaped;
+    entry *   prev;
+    entry *   next;
+  };
+
+private:
+  void Arm ( entry * e, DWORD now, DWORD timeout );
+  void Disarm ( entry * e );
+
+// there's no sane way of copying the reaper
+private:
+  HandshakeReaper ( const HandshakeReaper & r );
+  HandshakeReaper & operator= ( const HandshakeReaper & r );
+
+private:
+  DWORD                m_leg_timeout;
+  ULONG                m_max_handshakes;
+  ULONG                m_max_bytes;
+  DWORD                m_tick;
+  //! the wheel: a list of entries per slot
+  std::vector<entry*>  m_slots;
+  //! last tick we processed, and when it started
+  ULONGLONG            m_last;
+  DWORD                m_last_ms;
+  ULONG                m_in_flight;
+  ULONG                m_bytes;
+  ULONG                m_reaped;
+  mutable Winterdom::Runtime::Threading::CriticalSection m_lock;
+}; // class HandshakeReaper
+
+#endif // SSPIREAP_H__INCLUDED
@@ -0,0 +1,73 @@
+//==============================================================================
+// File: 			    sspireg.h
+//
+// Description: 	declaration of our server credentials registry
+//
+//==============================================================================
+// Copyright(C) 2000, Tomas Restrepo. All rights reserved
+// Send comments to: tomasr@mvps.org
+//==============================================================================
+
+#ifndef SSPIREG_H__INCLUDED
+#define SSPIREG_H__INCLUDED
+
+#if _MSC_VER > 1000
+#pragma once
+#endif // _MSC_VER > 1000
+
+/**
+  CredentialsRegistry maps target names (service
+  principals) to the server Credentials to accept them 
+  with, for front ends serving many of them.
+
+  Lookups never take a lock: the set of credentials is
+  an immutable table, replaced as a whole by the writers
+  (Publish(), Retire(), Replace()) with an atomic pointer
+  swap. The old table is deleted once every lookup that
+  could still see it is done, in the manner of RCU: 
+  lookups announce themselves in one of two counters,
+  picked by an epoch that writers flip while they wait
+  for the old counter to drain. Writers wait for each
+  other and for lookups in progress; lookups never wait.
+
+  Find() hands out a reference, so retired credentials
+  stay alive until the contexts using them let go.
+*/
+class CredentialsRegistry
+{
+public:
+  typedef std::map<wsstring, CredentialsRef> crmap;
+
+  CredentialsRegistry ( );
+  ~CredentialsRegistry ( );
+
+  CredentialsRef Find ( const wsstring & target ) const;
+  size_t Size ( ) const;
+
+  void Publish ( const wsstring & target, const CredentialsRef & cred );
+  void Retire ( const wsstring & target );
+  void Replace ( const crmap & creds );
+
+private:
+  const crmap * Enter ( long & epoch ) const;
+  void Leave ( long epoch ) const;
+  void Swap ( crmap * next );
+  void Synchronize ( );
+
+// there's no sane way of copying the registry
+private:
+  CredentialsRegistry ( const CredentialsRegistry & reg );
+  CredentialsRegistry & operator= ( const CredentialsRegistry & reg );
+
+private:
+  //! the current table
+  crmap * volatile   m_table;
+  //! picks the counter new lookups use
+  volatile long      m_epoch;
+  //! lookups in progress, by epoch parity
+  mutable volatile long m_readers[2];
+  //! serializes the writers
+  Winterdom::Runtime::Threading::CriticalSection m_write_lock;
+}; // class CredentialsRegistry
+
+#endif // SSPIREG_H__INCLUDED
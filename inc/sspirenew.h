@@ -0,0 +1,83 @@
+//==============================================================================
+// File: 			    sspirenew.h
+//
+// Description: 	declaration of our context renewal scheduler
+//
+//==============================================================================
+// Copyright(C) 2000, Tomas Restrepo. All rights reserved
+// Send comments to: tomasr@mvps.org
+//==============================================================================
+
+#ifndef SSPIRENEW_H__INCLUDED
+#define SSPIRENEW_H__INCLUDED
+
+#if _MSC_VER > 1000
+#pragma once
+#endif // _MSC_VER > 1000
+
+/**
+  RenewalHandler is the interface RenewalScheduler
+  uses to tell you a context is about to expire.
+*/
+class RenewalHandler
+{
+public:
+  /**
+    Called once per tracked context, lead milliseconds
+    before it expires (or right away if it's closer
+    than that). Renegotiate it in the background: 
+    for stream packages, Context::Renegotiate() and 
+    another round of Authenticate(); for message 
+    packages, a new context to switch over to. Track()
+    the context again once it's renewed.
+  */
+  virtual void OnRenewalDue ( Context * ctxt ) =0;
+}; // class RenewalHandler
+
+
+/**
+  RenewalScheduler watches the lifespan of established
+  contexts, so long lived connections get renegotiated
+  ahead of time instead of failing with 
+  SEC_E_CONTEXT_EXPIRED under load.
+
+  Call Poll() periodically, or wait NextDue() 
+  milliseconds between calls. Everything can be called
+  from any thread; the handler is called from Poll(),
+  without the scheduler's lock held.
+*/
+class RenewalScheduler
+{
+public:
+  RenewalScheduler ( RenewalHandler & handler, DWORD lead = 300000 );
+
+  void Track ( Context * ctxt );
+  void Untrack ( Context * ctxt );
+  ULONG Poll ( );
+  DWORD NextDue ( ) const;
+  size_t Size ( ) const;
+
+private:
+  typedef std::multimap<ULONGLONG, Context*> rdue;
+  typedef std::map<Context*, rdue::iterator> rctxts;
+
+  ULONGLONG Now ( ) const;
+
+// there's no sane way of copying the scheduler
+private:
+  RenewalScheduler ( const RenewalScheduler & s );
+  RenewalScheduler & operator= ( const RenewalScheduler & s );
+
+private:
+  RenewalHandler &   m_handler;
+  DWORD              m_lead;
+  //! contexts by due time (see Now())
+  rdue               m_due;
+  rctxts             m_ctxts;
+  //! for our 64 bit clock
+  mutable DWORD      m_last_tick;
+  mutable ULONGLONG  m_clock;
+  mutable Winterdom::Runtime::Threading::CriticalSection m_lock;
+}; // class RenewalScheduler
+
+#endif // SSPIRENEW_H__INCLUDED
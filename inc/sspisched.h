@@ -0,0 +1,128 @@
+//==============================================================================
+// File: 			    sspisched.h
+//
+// Description: 	declaration of our handshake scheduler
+//
+//==============================================================================
+// Copyright(C) 2000, Tomas Restrepo. All rights reserved
+// Send comments to: tomasr@mvps.org
+//==============================================================================
+
+#ifndef SSPISCHED_H__INCLUDED
+#define SSPISCHED_H__INCLUDED
+
+#if _MSC_VER > 1000
+#pragma once
+#endif // _MSC_VER > 1000
+
+/**
+  A snapshot of the scheduler counters
+*/
+struct SchedulerStats
+{
+  //! tasks waiting, by queue
+  ULONG queued_data;
+  ULONG queued_handshakes;
+  //! largest handshake backlog seen
+  ULONG peak_handshakes;
+  //! new handshakes let in by Admit()
+  ULONG admitted;
+  //! new handshakes turned away because the queue was full
+  ULONG shed_queue;
+  //! new handshakes turned away by the per-source rate limit
+  ULONG shed_rate;
+  //! tasks run, by queue
+  ULONG ran_data;
+  ULONG ran_handshakes;
+};
+
+
+/**
+  HandshakeScheduler is an Executor with its own worker
+  threads, which keeps handshake work from crowding out
+  work on established sessions during a login storm.
+
+  Tasks go into one of two queues, depending on 
+  Task::DataPlane(): data plane work (EncryptMessage(), 
+  DecryptMessage() and the like) is always picked first, 
+  handshake legs run only when there's no data plane 
+  work waiting.
+
+  Admission control happens before a handshake starts:
+  call Admit() with something identifying the peer 
+  (its IPv4 address, say) when a connection comes in, 
+  and drop the connection right away if it returns false.
+  Admit() refuses new handshakes when the handshake
+  backlog is at max_backlog, or when the source has used
+  up its token bucket (rate new handshakes per second,
+  up to burst at once). Legs of handshakes already
+  admitted are never refused, so nobody gets cut off
+  halfway.
+
+  At most max_sources sources get a bucket of their own.
+  Once that many are active, new sources all share a
+  single overflow bucket until idle ones can be forgotten,
+  so a flood of distinct sources can't grow the table
+  without limit (or buy itself fresh buckets).
+
+  Everything can be called from any thread.
+*/
+class HandshakeScheduler : public Executor
+{
+public:
+  HandshakeScheduler ( 
+        ULONG threads, 
+        ULONG max_backlog, 
+        ULONG rate, 
+        ULONG burst 
+      );
+  ~HandshakeScheduler ( );
+
+  bool Admit ( ULONG source );
+  void Post ( Task * task );
+  SchedulerStats Stats ( ) const;
+
+  //! we forget about sources this long idle (ms)
+  enum { source_idle = 60000 };
+  //! and start forgetting when we track this many,
+  //! which is also as many as we'll ever track
+  enum { max_sources = 4096 };
+
+private:
+  //! token bucket for one source, in thousandths of a token
+  struct bucket {
+    ULONG tokens;
+    DWORD last;
+  };
+  typedef std::map<ULONG, bucket> bmap;
+  typedef std::deque<Task*> tdeque;
+
+  static unsigned __stdcall WorkerProc ( void * param );
+  void Worker ( );
+  void StopWorkers ( );
+  bool Take ( bucket & b, DWORD now );
+  void Prune ( DWORD now );
+
+// there's no sane way of copying the scheduler
+private:
+  HandshakeScheduler ( const HandshakeScheduler & s );
+  HandshakeScheduler & operator= ( const HandshakeScheduler & s );
+
+private:
+  ULONG               m_max_backlog;
+  ULONG               m_rate;
+  ULONG               m_burst;
+  tdeque              m_data;
+  tdeque              m_handshakes;
+  bmap                m_sources;
+  //! shared by sources we've no room to track
+  bucket              m_overflow;
+  bool                m_stop;
+  SchedulerStats      m_stats;
+  std::vector<HANDLE> m_threads;
+  //! counts queued tasks (and stop requests)
+  Winterdom::Runtime::Threading::Semaphore m_work;
+  mutable Winterdom::Runtime::Threading::CriticalSection m_lock;
+}; // class HandshakeScheduler
+
+#endif // SSPISCHED_H__INCLUDED
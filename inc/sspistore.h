@@ -0,0 +1,132 @@
+//==============================================================================
+// File: 			    sspistore.h
+//
+// Description: 	declaration of our persistent session store
+//
+//==============================================================================
+// Copyright(C) 2000, Tomas Restrepo. All rights reserved
+// Send comments to: tomasr@mvps.org
+//==============================================================================
+
+#ifndef SSPISTORE_H__INCLUDED
+#define SSPISTORE_H__INCLUDED
+
+#if _MSC_VER > 1000
+#pragma once
+#endif // _MSC_VER > 1000
+
+/**
+  SessionHandler is the interface SessionStore::ImportAll()
+  uses to hand back the sessions it restores. With an 
+  executor, it's called from several threads at once.
+*/
+class SessionHandler
+{
+public:
+  /**
+    ctxt was allocated with new, and is yours
+  */
+  virtual void OnSessionRestored ( ULONGLONG id, ServerContext * ctxt ) =0;
+  /**
+    The session couldn't be imported (it expired,
+    say). error is an SSPI error code.
+  */
+  virtual void OnSessionFailed ( ULONGLONG id, DWORD error ) { }
+}; // class SessionHandler
+
+
+/**
+  SessionStore keeps established server contexts, 
+  exported with Context::Export(), in a memory mapped
+  file indexed by session id, so that a restarted 
+  worker can pick up its sessions without making every
+  client go through a full handshake again.
+
+  Records are only ever appended: saving a session 
+  again or removing it just marks the old record dead.
+  The file grows as needed, and Compact() squeezes the 
+  dead records out. At start up, ImportAll() imports 
+  every live session, in parallel on an Executor.
+
+  Note that exported contexts hold session keys: protect
+  the file as you would the keys themselves (restrict
+  its ACL, keep it off shared storage).
+
+  Save(), Load(), Remove() and Compact() can be called
+  from any thread; they're serialized. ImportAll() works 
+  on a copy of the sessions, so its handler can use the
+  store too.
+
+  Save() is crash-safe: a record only counts once it's
+  complete. Compact() isn't, since it moves records in 
+  place: Flush() and back up the file first if you can't
+  afford to lose the sessions.
+*/
+class SessionStore
+{
+public:
+  SessionStore ( const TCHAR * path, DWORD initial_size = 0x100000 );
+  ~SessionStore ( );
+
+  void Save ( ULONGLONG id, Context & ctxt );
+  bool Load ( ULONGLONG id, Context & ctxt );
+  void Remove ( ULONGLONG id );
+  ULONG ImportAll ( 
+        Credentials & cred, 
+        SessionHandler & handler, 
+        Executor * exec = 0 
+      );
+  void Compact ( );
+  void Flush ( );
+  size_t Size ( ) const;
+
+private:
+  //! start of the file
+  struct file_header {
+    DWORD magic;
+    DWORD version;
+    //! bytes in use, header included
+    DWORD used;
+    DWORD reserved;
+  };
+  //! start of each record, followed by the blob
+  struct record {
+    DWORD     magic;
+    DWORD     live;
+    ULONGLONG id;
+    DWORD     size;
+    DWORD     reserved;
+  };
+  //! a session copied out for ImportAll()
+  struct import_entry {
+    ULONGLONG id;
+    DWORD     offset;   // into the copied blobs
+    DWORD     size;
+  };
+  //! a batch of sessions for ImportAll()
+  struct import_task;
+  friend struct import_task;
+  typedef std::map<ULONGLONG, DWORD> sindex;
+
+  void Map ( DWORD size );
+  void Unmap ( );
+  void Index ( );
+  record * At ( DWORD offset ) const;
+  static DWORD RecordSize ( DWORD blob );
+
+// there's no sane way of copying the store
+private:
+  SessionStore ( const SessionStore & store );
+  SessionStore & operator= ( const SessionStore & store );
+
+private:
+  HANDLE      m_file;
+  HANDLE      m_mapping;
+  BYTE *      m_view;
+  DWORD       m_size;
+  //! offset of the live record of each session
+  sindex      m_index;
+  mutable Winterdom::Runtime::Threading::CriticalSection m_lock;
+}; // class SessionStore
+
+#endif // SSPISTORE_H__INCLUDED
@@ -0,0 +1,98 @@
+//==============================================================================
+// File: 			    sspitok.h
+//
+// Description: 	declaration of our token size tracking class
+//
+//==============================================================================
+// Copyright(C) 2000, Tomas Restrepo. All rights reserved
+// Send comments to: tomasr@mvps.org
+//==============================================================================
+
+#ifndef SSPITOK_H__INCLUDED
+#define SSPITOK_H__INCLUDED
+
+#if _MSC_VER > 1000
+#pragma once
+#endif // _MSC_VER > 1000
+
+// opaque, see TokenSizes::Find()
+struct TokenStats;
+
+/**
+  TokenSizes keeps track of the size of the tokens
+  actually produced during authentication, per package,
+  per side (client or server) and per leg.
+
+  SecPkg::MaxTokenSize() is a worst case figure (it can be
+  48K for Kerberos/Negotiate) while real tokens are usually
+  a fraction of that. Context::Authenticate() uses
+  TokenSizes::Hint() to size its output buffers when
+  running in ta_adaptive mode.
+
+  The statistics for a package and side live in a 
+  TokenStats record, which Find() looks up (taking a lock)
+  and which never moves afterwards. Credentials keep theirs
+  around, so Hint() and Record() don't lock, or even look
+  anything up, on the handshake path.
+
+  Everything is static and thread-safe, since the 
+  statistics are shared by every Context in the process.
+*/
+class TokenSizes
+{
+public:
+  //! legs beyond this one share the last slot
+  enum { max_legs = 8 };
+
+  static TokenStats * Find ( const TCHAR * pkg, bool server );
+
+  static ULONG Hint ( TokenStats * stats, ULONG leg, ULONG max_token );
+  static void Record ( TokenStats * stats, ULONG leg, ULONG size );
+  static ULONG Hint ( 
+        const wsstring & pkg, bool server, 
+        ULONG leg, ULONG max_token 
+      );
+  static void Record ( 
+        const wsstring & pkg, bool server, 
+        ULONG leg, ULONG size 
+      );
+  static void Reset ( );
+
+private:
+  typedef std::map<wsstring, TokenStats*> tsmap;
+
+  static TokenStats * Lookup ( const wsstring & pkg, bool server, bool create );
+
+private:
+  //! statistics lock
+  static Winterdom::Runtime::Threading::CriticalSection m_lock;
+  //! the records, by package and side
+  static tsmap m_stats;
+
+  friend class HandshakeLegs;
+}; // class TokenSizes
+
+
+/**
+  HandshakeLegs counts how many legs (calls to
+  Context::Authenticate()) completed handshakes took,
+  per package and side. Use it to check that, say, Negotiate
+  is taking the short Kerberos path instead of falling back
+  to NTLM (see NtCredentials' package list).
+
+  The counters live in the same TokenStats records as
+  the token sizes. All members are static and thread-safe.
+*/
+class HandshakeLegs
+{
+public:
+  //! handshakes longer than this are counted here
+  enum { max_legs = 8 };
+
+  static void Record ( TokenStats * stats, ULONG legs );
+  static void Record ( const wsstring & pkg, bool server, ULONG legs );
+  static ULONG Count ( const wsstring & pkg, bool server, ULONG legs );
+  static void Reset ( );
+}; // class HandshakeLegs
+
+#endif // SSPITOK_H__INCLUDED
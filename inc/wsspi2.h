@@ -30,9 +30,16 @@
   #include <windows.h>
   #include <tchar.h>
   #include <exception>
+  #include <new>
   #include <string>
   #include <ostream>
+  #include <sstream>
   #include <vector>
+  #include <map>
+  #include <deque>
+  #include <list>
+  #include <set>
+  #include <algorithm>
   #include <assert.h>
   #include "wsync.h"
 
@@ -72,6 +79,12 @@
 // we can also improve some exception semantics
 #define no_throw __declspec(nothrow)
 
+// the socket classes only need SOCKET in their headers.
+// It's the same definition winsock.h and winsock2.h use,
+// so either one can be included before or after us; 
+// only the socket classes pull in (and link) winsock2
+typedef UINT_PTR SOCKET;
+
 namespace WSSPI2 {
 
 // unicode/ansi definitions
@@ -88,8 +101,32 @@ namespace WSSPI2 {
   #include "sspilib.h"
   #include "sspipkg.h"
   #include "sspibuf.h"
+  #include "sspimem.h"
+  #include "sspitok.h"
+  #include "sspiauthz.h"
+  #include "sspicost.h"
   #include "sspicred.h"
+// these helpers catch SspiEx to clean up after
+// failures, so they need exceptions
+#ifndef WSSPI_NO_EXCEPTIONS
+  #include "sspicache.h"
+  #include "sspireg.h"
+#endif
   #include "sspictxt.h"
+  #include "sspiimp.h"
+#ifndef WSSPI_NO_EXCEPTIONS
+  #include "sspiprime.h"
+#endif
+  #include "sspiexec.h"
+  #include "sspisched.h"
+  #include "sspireap.h"
+  #include "sspirenew.h"
+#ifndef WSSPI_NO_EXCEPTIONS
+  #include "sspistore.h"
+  #include "sspichan.h"
+  #include "sspihand.h"
+  #include "sspidrv.h"
+#endif
 }
 
 #endif // WSSPI2_H__INCLUDED
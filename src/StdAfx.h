@@ -12,6 +12,9 @@
 
 //#define WIN32_LEAN_AND_MEAN		// Exclude rarely-used stuff from Windows headers
 #define WSSPI_NO_AUTO_LINK
+// the socket classes use winsock2, which 
+// must come before windows.h
+#include <winsock2.h>
 #include "..\inc\wsspi2.h"
 
 // TODO: reference additional headers your program requires here
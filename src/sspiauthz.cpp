@@ -0,0 +1,249 @@
+//==============================================================================
+// File: 			    sspiauthz.cpp
+//
+// Description: 	implementation of our principal table and authorization cache
+//
+//==============================================================================
+// Copyright(C) 2000, Tomas Restrepo. All rights reserved
+// Send comments to: tomasr@mvps.org
+//==============================================================================
+
+#include "stdafx.h"
+
+using namespace WSSPI2;
+
+// static objects
+using namespace Winterdom::Runtime;
+Threading::CriticalSection PrincipalTable::m_lock;
+PrincipalTable::ptmap PrincipalTable::m_principals;
+
+
+// == Principal ==
+
+Principal::Principal ( const wsstring & name, ULONG id )
+  : m_name ( name ),
+    m_id ( id )
+{
+}
+
+const wsstring & Principal::Name ( ) const
+{
+  return m_name;
+}
+
+/**
+  Returns a small number, unique to this
+  principal within the process
+*/
+ULONG Principal::Id ( ) const
+{
+  return m_id;
+}
+
+
+// == PrincipalTable ==
+
+/**
+  Returns the principal for name, adding it if needed
+*/
+const Principal * PrincipalTable::Intern ( const wsstring & name )
+{
+  Threading::CriticalSectionLock autolock(m_lock);
+  ptmap::iterator it = m_principals.find ( name );
+  if ( it != m_principals.end ( ) )
+    return it->second;
+
+  Principal * p = new Principal ( name, m_principals.size ( ) + 1 );
+  if ( p == 0 ) throwex ( err_no_memory );
+  m_principals[name] = p;
+  return p;
+}
+
+/**
+  Returns the principal for name, or NULL if
+  it has never been interned
+*/
+const Principal * PrincipalTable::Find ( const wsstring & name )
+{
+  Threading::CriticalSectionLock autolock(m_lock);
+  ptmap::iterator it = m_principals.find ( name );
+  return (it != m_principals.end ( )) ? it->second : 0;
+}
+
+size_t PrincipalTable::Size ( )
+{
+  Threading::CriticalSectionLock autolock(m_lock);
+  return m_principals.size ( );
+}
+
+
+// == AuthzCache ==
+
+AuthzCache::AuthzCache ( size_t capacity, DWORD ttl )
+  : m_capacity ( capacity ),
+    m_ttl ( ttl ),
+    m_generation ( 0 ),
+    m_hits ( 0 ),
+    m_misses ( 0 )
+{
+  assert ( capacity > 0 );
+}
+
+/**
+  Decides whether the client of ctxt may access
+  resource_class, asking eval only if we don't have
+  a decision cached for its principal. Contexts without
+  a principal are always evaluated. If the cache is
+  invalidated while eval runs, the decision isn't
+  stored, since it may be based on stale groups.
+*/
+bool AuthzCache::Check ( 
+      ServerContext & ctxt, 
+      ULONG resource_class, 
+      AuthzEvaluator & eval 
+    )
+{
+  const Principal * p = ctxt.GetPrincipal ( );
+  bool allowed = false;
+  if ( p != 0 && Lookup ( p, resource_class, allowed ) )
+    return allowed;
+
+  ULONG generation = Generation ( );
+  allowed = eval.Evaluate ( ctxt, resource_class );
+  if ( p != 0 )
+    Store ( p, resource_class, allowed, generation );
+  return allowed;
+}
+
+/**
+  Looks up a cached decision. Returns false if 
+  there's none (or it expired).
+*/
+bool AuthzCache::Lookup ( 
+      const Principal * principal, 
+      ULONG resource_class, 
+      bool & allowed 
+    )
+{
+  Threading::CriticalSectionLock autolock(m_lock);
+  acmap::iterator it = m_decisions.find ( akey ( principal, resource_class ) );
+  if ( it == m_decisions.end ( ) )
+  {
+    m_misses++;
+    return false;
+  }
+  if ( (GetTickCount ( ) - it->second.stored) >= m_ttl )
+  {
+    m_lru.erase ( it->second.lru );
+    m_decisions.erase ( it );
+    m_misses++;
+    return false;
+  }
+  // move it to the front
+  m_lru.splice ( m_lru.begin ( ), m_lru, it->second.lru );
+  allowed = it->second.allowed;
+  m_hits++;
+  return true;
+}
+
+/**
+  Caches a decision, evicting the least
+  recently used one if we're full
+*/
+void AuthzCache::Store ( 
+      const Principal * principal, 
+      ULONG resource_class, 
+      bool allowed 
+    )
+{
+  Store ( principal, resource_class, allowed, Generation ( ) );
+}
+
+/**
+  Returns the current generation, to pass to
+  Store() once a decision has been evaluated
+*/
+ULONG AuthzCache::Generation ( ) const
+{
+  Threading::CriticalSectionLock autolock(m_lock);
+  return m_generation;
+}
+
+/**
+  Caches a decision evaluated since generation,
+  unless the cache has been invalidated meanwhile
+*/
+void AuthzCache::Store ( 
+      const Principal * principal, 
+      ULONG resource_class, 
+      bool allowed,
+      ULONG generation
+    )
+{
+  assert ( principal != 0 );
+  akey key ( principal, resource_class );
+  Threading::CriticalSectionLock autolock(m_lock);
+  if ( generation != m_generation )
+    return;
+  acmap::iterator it = m_decisions.find ( key );
+  if ( it != m_decisions.end ( ) )
+  {
+    m_lru.splice ( m_lru.begin ( ), m_lru, it->second.lru );
+  }
+  else
+  {
+    if ( m_decisions.size ( ) >= m_capacity )
+    {
+      m_decisions.erase ( m_lru.back ( ) );
+      m_lru.pop_back ( );
+    }
+    m_lru.push_front ( key );
+    it = m_decisions.insert ( acmap::value_type ( key, decision ( ) ) ).first;
+    it->second.lru = m_lru.begin ( );
+  }
+  it->second.allowed = allowed;
+  it->second.stored  = GetTickCount ( );
+}
+
+/**
+  Drops every decision cached for principal. The
+  generation goes up, so decisions being evaluated
+  right now (for any principal) aren't stored
+*/
+void AuthzCache::Invalidate ( const Principal * principal )
+{
+  Threading::CriticalSectionLock autolock(m_lock);
+  m_generation++;
+  acmap::iterator it = m_decisions.lower_bound ( akey ( principal, 0 ) );
+  while ( it != m_decisions.end ( ) && it->first.first == principal )
+  {
+    m_lru.erase ( it->second.lru );
+    m_decisions.erase ( it++ );
+  }
+}
+
+void AuthzCache::Clear ( )
+{
+  Threading::CriticalSectionLock autolock(m_lock);
+  m_generation++;
+  m_decisions.clear ( );
+  m_lru.clear ( );
+}
+
+size_t AuthzCache::Size ( ) const
+{
+  Threading::CriticalSectionLock autolock(m_lock);
+  return m_decisions.size ( );
+}
+
+ULONG AuthzCache::Hits ( ) const
+{
+  Threading::CriticalSectionLock autolock(m_lock);
+  return m_hits;
+}
+
+ULONG AuthzCache::Misses ( ) const
+{
+  Threading::CriticalSectionLock autolock(m_lock);
+  return m_misses;
+}
@@ -23,6 +23,9 @@ Buffer::Buffer ( )
   m_buffer.cbBuffer   = 0;
   m_buffer.BufferType = 0;
   m_buffer.pvBuffer   = 0;
+#ifndef WSSPI_NO_BUFFER_STATS
+  m_acct_mem = 0;
+#endif
 }
 Buffer::~Buffer ( )
 {
@@ -31,31 +34,70 @@ Buffer::~Buffer ( )
 
 // == copy ctor/assignment ==
 Buffer::Buffer ( const Buffer & buf )
+  : m_owner ( bo_user )
 {
+  m_buffer.cbBuffer   = 0;
+  m_buffer.BufferType = 0;
+  m_buffer.pvBuffer   = 0;
+#ifndef WSSPI_NO_BUFFER_STATS
+  m_acct_mem = 0;
+#endif
+
+  AllocateStorage ( buf.Size ( ) );
   m_owner = bo_lib;
   m_buffer.cbBuffer   = buf.Size ( );
   m_buffer.BufferType = buf.Type ( );
-  m_buffer.pvBuffer   = new BYTE[buf.Size ( )];
-  if ( m_buffer.pvBuffer == 0 )
-    throwex ( err_no_memory );
   memcpy ( m_buffer.pvBuffer, buf.ByteStream ( ), buf.Size ( ) );
+  Account ( );
 }
 
 Buffer & Buffer::operator= ( const Buffer & buf )
 {
   if ( &buf != this )
   {
+    Free ( );
+    AllocateStorage ( buf.Size ( ) );
     m_owner = bo_lib;
     m_buffer.cbBuffer   = buf.Size ( );
     m_buffer.BufferType = buf.Type ( );
-    m_buffer.pvBuffer   = new BYTE[buf.Size ( )];
-    if ( m_buffer.pvBuffer == 0 )
-      throwex ( err_no_memory );
     memcpy ( m_buffer.pvBuffer, buf.ByteStream ( ), buf.Size ( ) );
+    Account ( );
   }
   return *this;
 }
 
+/**
+  Exchanges contents (and ownership) with buf,
+  without copying anything that lives on the heap
+*/
+void Buffer::Swap ( Buffer & buf )
+{
+  if ( &buf == this )
+    return;
+  bool was_inline     = IsInline ( );
+  bool buf_was_inline = buf.IsInline ( );
+  Unaccount ( );
+  buf.Unaccount ( );
+  std::swap ( m_owner, buf.m_owner );
+  std::swap ( m_buffer, buf.m_buffer );
+#if WSSPI_BUFFER_INLINE_SIZE > 0
+  // inline contents stay put, so move them too
+  if ( was_inline || buf_was_inline )
+  {
+    BYTE tmp[WSSPI_BUFFER_INLINE_SIZE];
+    memcpy ( tmp, m_inline, sizeof(tmp) );
+    memcpy ( m_inline, buf.m_inline, sizeof(tmp) );
+    memcpy ( buf.m_inline, tmp, sizeof(tmp) );
+    if ( was_inline )
+      buf.m_buffer.pvBuffer = (void*)buf.m_inline;
+    if ( buf_was_inline )
+      m_buffer.pvBuffer = (void*)m_inline;
+  }
+#endif
+  Account ( );
+  buf.Account ( );
+}
+
 // == serialization support ==
 /**
   Assigns the referenced stream to this instance
@@ -72,6 +114,7 @@ void Buffer::FromByteStream ( const BYTE * stream, DWORD size, buffer_type type
   m_buffer.cbBuffer   = size;
   m_buffer.BufferType = type;
   m_buffer.pvBuffer   = (void*)stream;
+  Account ( );
 }
 /**
   Returns a const pointer to the internal data stream
@@ -94,12 +137,10 @@ const BYTE * Buffer::ByteStream ( ) const
 void Buffer::Allocate ( DWORD size, buffer_type type )
 { 
   Free ( );
-  m_buffer.pvBuffer = (void*) new BYTE[size];
-  if ( m_buffer.pvBuffer == 0 )
-    throwex ( err_no_memory );
+  AllocateStorage ( size );
   SetSize ( size );
-  SetOwner ( bo_lib );
   SetType ( type );
+  SetOwner ( bo_lib );
 }
 /**
   Get a non-const pointer to the internal data stream.
@@ -189,10 +230,15 @@ buffer_owner Buffer::Owner ( ) const
   Sets the buffer owner. 
   This is used internally by the library, and you should not
   have to call it yourself, as it could be dangerous.
+
+  The memory currently referenced is accounted in 
+  BufferStats under the new owner, so set the owner after
+  the memory has been attached.
 */
 void Buffer::SetOwner ( buffer_owner owner )
 {
   m_owner = owner;  
+  Account ( );
 }
 
 /**
@@ -211,6 +257,7 @@ void Buffer::Free ( )
 {
   if ( m_buffer.pvBuffer == 0 )
     return;
+  Unaccount ( );
   switch ( m_owner )
   {
   case bo_sspi: 
@@ -219,7 +266,8 @@ void Buffer::Free ( )
   case bo_user: 
     break;  // don't do anything
   case bo_lib:  
-    delete [] m_buffer.pvBuffer; 
+    if ( !IsInline ( ) )
+      delete [] (BYTE*)m_buffer.pvBuffer; 
     break;
   }
   m_buffer.pvBuffer = 0;
@@ -227,6 +275,71 @@ void Buffer::Free ( )
   m_buffer.BufferType = bt_empty;
 }
 
+/**
+  Points the internal SecBuffer to size bytes of
+  library owned memory. Small sizes are served from
+  the inline storage, larger ones from the heap.
+  The caller is responsible for releasing any
+  previous contents first.
+*/
+void Buffer::AllocateStorage ( DWORD size )
+{
+#if WSSPI_BUFFER_INLINE_SIZE > 0
+  if ( size <= WSSPI_BUFFER_INLINE_SIZE )
+  {
+    m_buffer.pvBuffer = (void*)m_inline;
+    return;
+  }
+#endif
+  m_buffer.pvBuffer = (void*) new BYTE[size];
+  if ( m_buffer.pvBuffer == 0 )
+    throwex ( err_no_memory );
+}
+
+/**
+  Is the buffer memory our inline storage?
+*/
+bool Buffer::IsInline ( ) const
+{
+#if WSSPI_BUFFER_INLINE_SIZE > 0
+  return (m_buffer.pvBuffer == (void*)m_inline);
+#else
+  return false;
+#endif
+}
+
+/**
+  Reports the memory we currently reference to
+  BufferStats, replacing whatever we reported before.
+*/
+void Buffer::Account ( )
+{
+#ifndef WSSPI_NO_BUFFER_STATS
+  Unaccount ( );
+  // bo_user memory isn't ours to count
+  if ( m_buffer.pvBuffer == 0 || m_owner == bo_user )
+    return;
+  m_acct_mem   = m_buffer.pvBuffer;
+  m_acct_size  = m_buffer.cbBuffer;
+  m_acct_type  = Type ( );
+  m_acct_owner = m_owner;
+  BufferStats::Add ( m_acct_owner, m_acct_type, m_acct_size, m_acct_mem );
+#endif
+}
+
+/**
+  Withdraws whatever we reported to BufferStats
+*/
+void Buffer::Unaccount ( )
+{
+#ifndef WSSPI_NO_BUFFER_STATS
+  if ( m_acct_mem == 0 )
+    return;
+  BufferStats::Remove ( m_acct_owner, m_acct_type, m_acct_size, m_acct_mem );
+  m_acct_mem = 0;
+#endif
+}
+
 
 //==============================================================================
 // BufferDesc implementation
@@ -309,6 +422,15 @@ size_t BufferDesc::size ( ) const
   return m_list.size ( );
 }
 
+/**
+  Removes all buffers from the descriptor
+*/
+void BufferDesc::clear ( )
+{
+  free ( );
+  m_list.clear ( );
+}
+
 // == buffer context management ==
 /**
   Returns a pointer to the internal SecBufferDesc
@@ -323,15 +445,27 @@ size_t BufferDesc::size ( ) const
   to the descriptor are replicated on it's buffers.
 */
 SecBufferDesc * BufferDesc::get_bd ( )
+{
+  SecBufferDesc * bd = try_get_bd ( );
+  if ( bd == 0 )
+    throwex ( err_no_memory );
+  return bd;
+}
+
+/**
+  Like get_bd(), but returns 0 instead of 
+  throwing if we run out of memory.
+*/
+SecBufferDesc * BufferDesc::try_get_bd ( )
 {
   // allocate the array and fill it.
   // it's only valid until the next 
   // function call
   free ( );
   m_desc.cBuffers = size ( );
-  m_desc.pBuffers = new SecBuffer[m_desc.cBuffers];
+  m_desc.pBuffers = new (std::nothrow) SecBuffer[m_desc.cBuffers];
   if ( m_desc.pBuffers == 0 )
-    throwex ( err_no_memory );
+    return 0;
 
   ULONG i = 0;
   for ( iterator it = begin(); it != end(); it++, i++ )
@@ -367,3 +501,210 @@ void BufferDesc::free ( )
   m_desc.pBuffers = 0;
 }
 
+
+//==============================================================================
+// MessageFrame implementation
+
+MessageFrame::MessageFrame ( )
+  : m_stream ( false ),
+    m_header_room ( 0 ),
+    m_capacity ( 0 ),
+    m_trailer_room ( 0 ),
+    m_padding_room ( 0 ),
+    m_data_size ( 0 ),
+    m_wire ( 0 ),
+    m_wire_size ( 0 )
+{
+}
+
+/**
+  Allocates room for a message of size bytes
+  protected with ctxt. The header and trailer sizes
+  are taken from the context, so it must be a valid
+  (authenticated) one.
+
+  If the frame held a message previously, it is released.
+*/
+void MessageFrame::Prepare ( const Context & ctxt, DWORD size )
+{
+  assert ( ctxt.IsValid ( ) );
+
+  ULONG block = ctxt.BlockSize ( );
+  if ( block == 0 ) 
+    block = 1;
+
+  m_header_room = ctxt.StreamHeaderSize ( );
+  m_trailer_room = ctxt.StreamTrailerSize ( );
+  m_stream = (m_header_room != 0 || m_trailer_room != 0);
+  if ( m_stream )
+  {
+    m_padding_room = 0;
+  }
+  else
+  {
+    // the token and its size go in front
+    m_header_room = sizeof(DWORD) + ctxt.SecurityTrailerSize ( );
+    m_padding_room = block;
+  }
+  m_capacity = ((size + block - 1) / block) * block;
+
+  DWORD total = m_header_room + m_capacity + m_trailer_room + m_padding_room;
+  total = ((total + block - 1) / block) * block;
+  m_storage.Allocate ( total, bt_data );
+
+  m_desc.clear ( );
+  m_desc.add ( m_parts, m_stream ? 4 : 3 );
+  SetDataSize ( size );
+}
+
+/**
+  Returns a pointer to the payload area. Copy (or recv())
+  your plaintext here before encrypting the frame. 
+  There's room for Capacity() bytes.
+*/
+BYTE * MessageFrame::Data ( )
+{
+  assert ( m_storage.IsValid ( ) );
+  return m_storage.GetBufferForRecv ( ) + m_header_room;
+}
+
+/**
+  Returns the size of the payload
+*/
+DWORD MessageFrame::DataSize ( ) const
+{
+  return m_data_size;
+}
+
+/**
+  Changes the size of the payload, without reallocating.
+  size must be less or equal to Capacity(). This is handy 
+  to reuse a frame for messages of different sizes.
+*/
+void MessageFrame::SetDataSize ( DWORD size )
+{
+  assert ( size <= m_capacity );
+  m_data_size = size;
+  Layout ( );
+}
+
+/**
+  Returns the maximum payload size this frame can hold
+*/
+DWORD MessageFrame::Capacity ( ) const
+{
+  return m_capacity;
+}
+
+/**
+  Returns the buffer descriptor over the frame parts,
+  ready to be handed to Context::EncryptMessage() or
+  Context::MakeSignature().
+*/
+BufferDesc & MessageFrame::Desc ( )
+{
+  return m_desc;
+}
+
+/**
+  Lays out the encrypted parts back to back so that 
+  WireData()/WireSize() describe a single record. 
+  Context::EncryptMessage ( ULONG, MessageFrame &, ULONG )
+  calls this for you.
+*/
+void MessageFrame::Seal ( )
+{
+  BYTE * data = Data ( );
+  if ( m_stream )
+  {
+    // the header must end right where the data starts
+    DWORD header = m_parts[0].Size ( );
+    BYTE * start = data - header;
+    if ( header < m_header_room )
+      memmove ( start, m_storage.GetBufferForRecv ( ), header );
+    m_wire = start;
+    m_wire_size = header + m_parts[1].Size ( ) + m_parts[2].Size ( );
+  }
+  else
+  {
+    // the token must end right where the data starts,
+    // with its size right in front of it
+    DWORD token   = m_parts[0].Size ( );
+    DWORD padding = m_parts[2].Size ( );
+    BYTE * start  = data - token - sizeof(DWORD);
+    if ( token < m_header_room - sizeof(DWORD) )
+      memmove ( data - token, m_storage.GetBufferForRecv ( ) + sizeof(DWORD), token );
+    // network order, without dragging in winsock
+    start[0] = (BYTE)(token >> 24);
+    start[1] = (BYTE)(token >> 16);
+    start[2] = (BYTE)(token >> 8);
+    start[3] = (BYTE)token;
+    m_wire = start;
+    m_wire_size = sizeof(DWORD) + token + m_data_size + padding;
+  }
+}
+
+/**
+  Returns a pointer to the sealed record
+*/
+const BYTE * MessageFrame::WireData ( ) const
+{
+  assert ( m_wire != 0 );
+  return m_wire;
+}
+
+/**
+  Returns the size of the sealed record
+*/
+DWORD MessageFrame::WireSize ( ) const
+{
+  return m_wire_size;
+}
+
+/**
+  Takes apart a record sealed by a message context 
+  (see the layout above) into token and data views 
+  over wire, ready for Context::DecryptMessage() or
+  VerifySignature(). The padding stays with the data.
+  The record comes from the peer, so this returns false
+  if the token size doesn't fit in it.
+*/
+bool MessageFrame::Split ( BYTE * wire, DWORD size, Buffer & token, Buffer & data )
+{
+  if ( wire == 0 || size < sizeof(DWORD) )
+    return false;
+  DWORD tsize = ((DWORD)wire[0] << 24) | ((DWORD)wire[1] << 16) 
+              | ((DWORD)wire[2] << 8) | (DWORD)wire[3];
+  if ( tsize > size - sizeof(DWORD) )
+    return false;
+  BYTE * p = wire + sizeof(DWORD);
+  token.FromByteStream ( p, tsize, bt_token );
+  data.FromByteStream ( p + tsize, size - sizeof(DWORD) - tsize, bt_data );
+  return true;
+}
+
+/**
+  Points our parts to the right places in the
+  storage, for the current payload size. The stream
+  trailer and the padding follow the payload directly.
+*/
+void MessageFrame::Layout ( )
+{
+  BYTE * data = Data ( );
+  if ( m_stream )
+  {
+    m_parts[0].FromByteStream ( m_storage.GetBufferForRecv ( ), m_header_room, bt_stream_header );
+    m_parts[1].FromByteStream ( data, m_data_size, bt_data );
+    m_parts[2].FromByteStream ( data + m_data_size, m_trailer_room, bt_stream_trailer );
+    m_parts[3].FromByteStream ( 0, 0, bt_empty );
+  }
+  else
+  {
+    m_parts[0].FromByteStream ( m_storage.GetBufferForRecv ( ) + sizeof(DWORD), 
+                                m_header_room - sizeof(DWORD), bt_token );
+    m_parts[1].FromByteStream ( data, m_data_size, bt_data );
+    m_parts[2].FromByteStream ( data + m_data_size, m_padding_room, bt_padding );
+  }
+  m_wire = 0;
+  m_wire_size = 0;
+}
@@ -0,0 +1,428 @@
+//==============================================================================
+// File: 			    sspicache.cpp
+//
+// Description: 	implementation of our process-wide credentials cache
+//
+//==============================================================================
+// Copyright(C) 2000, Tomas Restrepo. All rights reserved
+// Send comments to: tomasr@mvps.org
+//==============================================================================
+
+#include "stdafx.h"
+
+// needs exceptions, see sspiex.h
+#ifndef WSSPI_NO_EXCEPTIONS
+
+using namespace WSSPI2;
+using namespace Winterdom::Runtime;
+
+// static objects
+Threading::CriticalSection CredentialsCache::m_instance_lock;
+CredentialsCache * CredentialsCache::m_instance = 0;
+
+
+// == CredentialsSpec ==
+
+CredentialsSpec::CredentialsSpec ( 
+      NtCredentials::NtCredPkg p /*= NtCredentials::nt_negotiate*/,
+      Credentials::credentials_use u /*= Credentials::cu_client*/ 
+    )
+  : pkg ( p ),
+    use ( u ),
+    has_luid ( false )
+{
+  luid.LowPart  = 0;
+  luid.HighPart = 0;
+}
+
+bool CredentialsSpec::operator< ( const CredentialsSpec & spec ) const
+{
+  if ( pkg != spec.pkg ) return pkg < spec.pkg;
+  if ( use != spec.use ) return use < spec.use;
+  if ( has_luid != spec.has_luid ) return spec.has_luid;
+  if ( has_luid )
+  {
+    if ( luid.HighPart != spec.luid.HighPart ) 
+      return luid.HighPart < spec.luid.HighPart;
+    if ( luid.LowPart != spec.luid.LowPart ) 
+      return luid.LowPart < spec.luid.LowPart;
+  }
+  if ( target != spec.target ) return target < spec.target;
+  if ( packages != spec.packages ) return packages < spec.packages;
+  if ( domain != spec.domain ) return domain < spec.domain;
+  if ( user != spec.user ) return user < spec.user;
+  return password < spec.password;
+}
+
+
+// == CredentialsRef ==
+
+CredentialsRef::CredentialsRef ( )
+  : m_shared ( 0 )
+{
+}
+
+CredentialsRef::CredentialsRef ( SharedCredentials * shared )
+  : m_shared ( shared )
+{
+}
+
+CredentialsRef::CredentialsRef ( const CredentialsRef & ref )
+  : m_shared ( ref.m_shared )
+{
+  if ( m_shared != 0 )
+    InterlockedIncrement ( &m_shared->refs );
+}
+
+CredentialsRef & CredentialsRef::operator= ( const CredentialsRef & ref )
+{
+  if ( ref.m_shared != 0 )
+    InterlockedIncrement ( &ref.m_shared->refs );
+  CredentialsCache::Release ( m_shared );
+  m_shared = ref.m_shared;
+  return *this;
+}
+
+CredentialsRef::~CredentialsRef ( )
+{
+  CredentialsCache::Release ( m_shared );
+}
+
+/**
+  Takes ownership of cred (allocated with new), which
+  gets deleted along with the last reference to it
+*/
+CredentialsRef CredentialsRef::Adopt ( Credentials * cred )
+{
+  assert ( cred != 0 );
+  SharedCredentials * shared = new SharedCredentials;
+  if ( shared == 0 ) 
+  {
+    delete cred;
+    throwex ( err_no_memory );
+  }
+  shared->cred       = cred;
+  shared->refs       = 1;
+  shared->refreshing = false;
+  shared->at_limit   = false;
+  return CredentialsRef ( shared );
+}
+
+bool CredentialsRef::IsValid ( ) const
+{
+  return (m_shared != 0);
+}
+
+Credentials & CredentialsRef::operator* ( ) const
+{
+  assert ( m_shared != 0 );
+  return *m_shared->cred;
+}
+
+Credentials * CredentialsRef::operator-> ( ) const
+{
+  assert ( m_shared != 0 );
+  return m_shared->cred;
+}
+
+
+// == CredentialsCache ==
+
+CredentialsCache::CredentialsCache ( )
+  : m_lead ( 600000 ),
+    m_hits ( 0 ),
+    m_misses ( 0 )
+{
+}
+
+/**
+  Returns the cache. It lives until the 
+  process ends; Clear() it if you must.
+*/
+CredentialsCache & CredentialsCache::Instance ( )
+{
+  if ( !m_instance )
+  {
+    Threading::CriticalSectionLock autolock(m_instance_lock);
+      if ( !m_instance )
+        m_instance = new CredentialsCache;
+  }
+  return *m_instance;
+}
+
+/**
+  Returns credentials for spec, acquiring them if
+  they aren't cached yet or the cached ones have 
+  expired. Only one caller re-acquires expired 
+  credentials; the others wait for it.
+*/
+CredentialsRef CredentialsCache::Get ( const CredentialsSpec & spec )
+{
+  SharedCredentials * expired = 0;
+  {
+    Threading::CriticalSectionLock autolock(m_lock);
+    ccmap::iterator it = m_entries.find ( spec );
+    if ( it != m_entries.end ( ) )
+    {
+      InterlockedIncrement ( &it->second->refs );
+      if ( it->second->cred->TimeToExpiry ( ) > 0 )
+      {
+        InterlockedIncrement ( &m_hits );
+        return CredentialsRef ( it->second );
+      }
+      expired = it->second;
+    }
+  }
+
+  InterlockedIncrement ( &m_misses );
+  if ( expired != 0 )
+  {
+    SharedCredentials * shared = 0;
+    try {
+      shared = Renew ( spec, expired );
+    } catch ( ... ) {
+      Release ( expired );
+      throw;
+    }
+    Release ( expired );
+    return CredentialsRef ( shared );
+  }
+
+  // acquire without the lock held, so
+  // we don't hold up other specs
+  SharedCredentials * shared = Acquire ( spec );
+
+  Threading::CriticalSectionLock autolock(m_lock);
+  ccmap::iterator it = m_entries.find ( spec );
+  if ( it != m_entries.end ( ) )
+  {
+    // somebody beat us to it
+    Release ( shared );
+    shared = it->second;
+  }
+  else
+  {
+    m_entries[spec] = shared;
+  }
+  InterlockedIncrement ( &shared->refs );
+  return CredentialsRef ( shared );
+}
+
+/**
+  Sets how long before they expire (ms)
+  Refresh() re-acquires credentials
+*/
+void CredentialsCache::SetRefreshLead ( DWORD lead )
+{
+  Threading::CriticalSectionLock autolock(m_lock);
+  m_lead = lead;
+}
+
+/**
+  Re-acquires the credentials that expire within the 
+  refresh lead, skipping those that couldn't be
+  extended last time. Returns how many were replaced.
+  If acquisition fails, the old credentials stay cached
+  and we try again next time.
+*/
+ULONG CredentialsCache::Refresh ( )
+{
+  std::vector<CredentialsSpec> due;
+  std::vector<SharedCredentials*> old;
+  {
+    Threading::CriticalSectionLock autolock(m_lock);
+    ccmap::iterator it;
+    for ( it = m_entries.begin ( ); it != m_entries.end ( ); ++it )
+    {
+      SharedCredentials * s = it->second;
+      if ( s->refreshing || s->at_limit 
+           || s->cred->TimeToExpiry ( ) > m_lead )
+        continue;
+      due.push_back ( it->first );
+      old.push_back ( s );
+      InterlockedIncrement ( &s->refs );
+    }
+  }
+
+  ULONG count = 0;
+  for ( size_t i = 0; i < due.size ( ); i++ )
+  {
+    SharedCredentials * shared = 0;
+    try {
+      shared = Renew ( due[i], old[i] );
+#ifndef WSSPI_EX_THROW_NEW
+    } catch ( SspiEx & ) {
+    }
+#else
+    } catch ( SspiEx * e ) {
+      e->Free ( );
+    }
+#endif
+    if ( shared != 0 && shared != old[i] )
+      count++;
+    Release ( shared );
+    Release ( old[i] );
+  }
+  return count;
+}
+
+/**
+  Re-acquires the credentials cached for spec, if 
+  they're still old (which the caller holds a 
+  reference to). Returns a reference to whatever is
+  cached for spec afterwards: the new credentials, or
+  old if the new ones don't expire any later, or 
+  whatever replaced old meanwhile.
+*/
+SharedCredentials * CredentialsCache::Renew ( 
+        const CredentialsSpec & spec, 
+        SharedCredentials * old 
+      )
+{
+  // whoever renews holds this, so the
+  // others wait here for the result
+  Threading::CriticalSectionLock renewlock(m_renew_lock);
+  {
+    Threading::CriticalSectionLock autolock(m_lock);
+    ccmap::iterator it = m_entries.find ( spec );
+    if ( it != m_entries.end ( ) && it->second != old )
+    {
+      // somebody renewed them already
+      InterlockedIncrement ( &it->second->refs );
+      return it->second;
+    }
+    old->refreshing = true;
+  }
+
+  SharedCredentials * shared = 0;
+  try {
+    shared = Acquire ( spec );
+  } catch ( ... ) {
+    Threading::CriticalSectionLock autolock(m_lock);
+    old->refreshing = false;
+    throw;
+  }
+
+  SharedCredentials * unused = 0;
+  {
+    Threading::CriticalSectionLock autolock(m_lock);
+    old->refreshing = false;
+    if ( shared->cred->Expiration ( ).QuadPart <= old->cred->Expiration ( ).QuadPart )
+    {
+      // no better than what we have
+      old->at_limit = true;
+      unused = shared;
+      shared = old;
+    }
+    else
+    {
+      ccmap::iterator it = m_entries.find ( spec );
+      if ( it != m_entries.end ( ) && it->second == old )
+      {
+        // the cache's reference to old comes back to us
+        it->second = shared;
+        unused = old;
+      }
+      else if ( it == m_entries.end ( ) )
+      {
+        // cleared meanwhile
+        m_entries[spec] = shared;
+      }
+      else
+      {
+        unused = shared;
+        shared = it->second;
+      }
+    }
+    InterlockedIncrement ( &shared->refs );
+  }
+  Release ( unused );
+  return shared;
+}
+
+/**
+  Drops all cached credentials. Those still
+  referenced stay alive until released.
+*/
+void CredentialsCache::Clear ( )
+{
+  ccmap entries;
+  {
+    Threading::CriticalSectionLock autolock(m_lock);
+    entries.swap ( m_entries );
+  }
+  ccmap::iterator it;
+  for ( it = entries.begin ( ); it != entries.end ( ); ++it )
+    Release ( it->second );
+}
+
+size_t CredentialsCache::Size ( ) const
+{
+  Threading::CriticalSectionLock autolock(m_lock);
+  return m_entries.size ( );
+}
+
+ULONG CredentialsCache::Hits ( ) const
+{
+  return m_hits;
+}
+
+ULONG CredentialsCache::Misses ( ) const
+{
+  return m_misses;
+}
+
+/**
+  Acquires credentials for spec. The result holds
+  one reference, which belongs to the caller.
+*/
+SharedCredentials * CredentialsCache::Acquire ( const CredentialsSpec & spec )
+{
+  NtCredentials * cred = new NtCredentials ( 
+        spec.pkg, spec.use, 
+        spec.target.empty ( ) ? NULL : spec.target.c_str ( ),
+        spec.packages.empty ( ) ? NULL : spec.packages.c_str ( )
+      );
+  if ( cred == 0 ) throwex ( err_no_memory );
+  try {
+    if ( !spec.user.empty ( ) )
+      cred->AcquireAlternate ( 
+            spec.domain.empty ( ) ? NULL : spec.domain.c_str ( ),
+            spec.user.c_str ( ), spec.password.c_str ( )
+          );
+    else if ( spec.has_luid )
+      cred->AcquireAlternate ( &spec.luid );
+    else
+      cred->Acquire ( );
+  } catch ( ... ) {
+    delete cred;
+    throw;
+  }
+
+  SharedCredentials * shared = new SharedCredentials;
+  if ( shared == 0 ) 
+  {
+    delete cred;
+    throwex ( err_no_memory );
+  }
+  shared->cred       = cred;
+  shared->refs       = 1;
+  shared->refreshing = false;
+  shared->at_limit   = false;
+  return shared;
+}
+
+/**
+  Drops a reference, and the credentials 
+  with it if it was the last one
+*/
+void CredentialsCache::Release ( SharedCredentials * shared )
+{
+  if ( shared != 0 && InterlockedDecrement ( &shared->refs ) == 0 )
+  {
+    delete shared->cred;
+    delete shared;
+  }
+}
+
+#endif // WSSPI_NO_EXCEPTIONS
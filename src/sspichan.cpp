@@ -0,0 +1,247 @@
+//==============================================================================
+// File: 			    sspichan.cpp
+//
+// Description: 	implementation of our pool of authenticated client channels
+//
+//==============================================================================
+// Copyright(C) 2000, Tomas Restrepo. All rights reserved
+// Send comments to: tomasr@mvps.org
+//==============================================================================
+
+#include "stdafx.h"
+
+// needs exceptions, see sspiex.h
+#ifndef WSSPI_NO_EXCEPTIONS
+
+// only linked in by programs that use this code
+#pragma comment(lib, "ws2_32.lib")
+
+using namespace WSSPI2;
+using namespace Winterdom::Runtime;
+
+
+/**
+  Creates the pool. max_idle is how long (ms) a 
+  channel may sit unused before Evict() closes it.
+*/
+ChannelPool::ChannelPool ( 
+      ChannelConnector & connector, 
+      size_t max_per_target /*= 8*/, 
+      DWORD max_idle /*= 60000*/ 
+    )
+  : m_connector ( connector ),
+    m_max_per_target ( max_per_target ),
+    m_max_idle ( max_idle ),
+    m_hits ( 0 ),
+    m_misses ( 0 )
+{
+  assert ( max_per_target > 0 );
+}
+
+/**
+  Closes the idle channels. Leased ones 
+  must have been returned by now.
+*/
+ChannelPool::~ChannelPool ( )
+{
+  cpmap::iterator it;
+  for ( it = m_pools.begin ( ); it != m_pools.end ( ); ++it )
+  {
+    std::deque<Channel*> & idle = it->second.idle;
+    assert ( it->second.total == idle.size ( ) );
+    for ( size_t i = 0; i < idle.size ( ); i++ )
+      Close ( idle[i] );
+  }
+}
+
+/**
+  Returns a healthy, authenticated channel to target
+  with cred, opening one if none is idle. Returns NULL
+  if the target is at its limit.
+*/
+Channel * ChannelPool::Lease ( const wsstring & target, Credentials & cred )
+{
+  ckey key ( target, &cred );
+  for ( ;; )
+  {
+    Channel * ch = 0;
+    {
+      Threading::CriticalSectionLock autolock(m_lock);
+      target_pool & pool = m_pools[key];
+      if ( !pool.idle.empty ( ) )
+      {
+        // the most recently used one is the
+        // least likely to have been dropped
+        ch = pool.idle.back ( );
+        pool.idle.pop_back ( );
+      }
+      else if ( pool.total < m_max_per_target )
+      {
+        pool.total++;
+      }
+      else
+      {
+        return 0;
+      }
+    }
+
+    if ( ch == 0 )
+    {
+      InterlockedIncrement ( &m_misses );
+      try {
+        return Open ( target, cred );
+      } catch ( ... ) {
+        Forget ( key );
+        throw;
+      }
+    }
+    if ( IsHealthy ( *ch ) )
+    {
+      InterlockedIncrement ( &m_hits );
+      return ch;
+    }
+    // dead; try the next one
+    Close ( ch );
+    Forget ( key );
+  }
+}
+
+/**
+  Gives a leased channel back. Pass reusable = false
+  if the exchange over it failed, or left it in a state
+  the next user can't deal with; it gets closed.
+*/
+void ChannelPool::Return ( Channel * ch, bool reusable /*= true*/ )
+{
+  assert ( ch != 0 );
+  ckey key ( ch->target, ch->cred );
+  if ( !reusable || !ch->ctxt->IsValid ( ) )
+  {
+    Close ( ch );
+    Forget ( key );
+    return;
+  }
+  ch->idle_since = GetTickCount ( );
+  Threading::CriticalSectionLock autolock(m_lock);
+  m_pools[key].idle.push_back ( ch );
+}
+
+/**
+  Closes the channels idle for longer than the
+  maximum. Returns how many were closed.
+*/
+ULONG ChannelPool::Evict ( )
+{
+  std::vector<Channel*> stale;
+  DWORD now = GetTickCount ( );
+  {
+    Threading::CriticalSectionLock autolock(m_lock);
+    cpmap::iterator it = m_pools.begin ( );
+    while ( it != m_pools.end ( ) )
+    {
+      // oldest first
+      target_pool & pool = it->second;
+      while ( !pool.idle.empty ( ) 
+              && (now - pool.idle.front ( )->idle_since) >= m_max_idle )
+      {
+        stale.push_back ( pool.idle.front ( ) );
+        pool.idle.pop_front ( );
+        pool.total--;
+      }
+      if ( pool.total == 0 )
+        m_pools.erase ( it++ );
+      else
+        ++it;
+    }
+  }
+  for ( size_t i = 0; i < stale.size ( ); i++ )
+    Close ( stale[i] );
+  return stale.size ( );
+}
+
+/**
+  Returns the number of idle channels
+*/
+size_t ChannelPool::Idle ( ) const
+{
+  Threading::CriticalSectionLock autolock(m_lock);
+  size_t idle = 0;
+  cpmap::const_iterator it;
+  for ( it = m_pools.begin ( ); it != m_pools.end ( ); ++it )
+    idle += it->second.idle.size ( );
+  return idle;
+}
+
+ULONG ChannelPool::Hits ( ) const
+{
+  return m_hits;
+}
+
+ULONG ChannelPool::Misses ( ) const
+{
+  return m_misses;
+}
+
+/**
+  Opens and authenticates a new channel
+*/
+Channel * ChannelPool::Open ( const wsstring & target, Credentials & cred )
+{
+  Channel * ch = new Channel;
+  if ( ch == 0 ) throwex ( err_no_memory );
+  ch->s          = INVALID_SOCKET;
+  ch->ctxt       = 0;
+  ch->target     = target;
+  ch->cred       = &cred;
+  ch->idle_since = 0;
+  try {
+    ch->ctxt = new ClientContext;
+    if ( ch->ctxt == 0 ) throwex ( err_no_memory );
+    ch->ctxt->SetCredentials ( cred );
+    m_connector.Connect ( target, cred, ch->s, *ch->ctxt );
+  } catch ( ... ) {
+    Close ( ch );
+    throw;
+  }
+  return ch;
+}
+
+/**
+  Is an idle channel still good to use? It's not if
+  the context is (about to be) expired, or if the socket
+  is readable: the server closed the connection, or sent
+  something nobody asked for.
+*/
+bool ChannelPool::IsHealthy ( const Channel & ch )
+{
+  if ( !ch.ctxt->IsValid ( ) || ch.ctxt->TimeToExpiry ( ) < min_lifetime )
+    return false;
+
+  fd_set readable;
+  FD_ZERO ( &readable );
+  FD_SET ( ch.s, &readable );
+  timeval no_wait = { 0, 0 };
+  return (select ( 0, &readable, NULL, NULL, &no_wait ) == 0);
+}
+
+void ChannelPool::Close ( Channel * ch )
+{
+  if ( ch->s != INVALID_SOCKET )
+    closesocket ( ch->s );
+  delete ch->ctxt;
+  delete ch;
+}
+
+/**
+  A channel for key is gone for good
+*/
+void ChannelPool::Forget ( const ckey & key )
+{
+  Threading::CriticalSectionLock autolock(m_lock);
+  cpmap::iterator it = m_pools.find ( key );
+  assert ( it != m_pools.end ( ) && it->second.total > 0 );
+  if ( --it->second.total == 0 )
+    m_pools.erase ( it );
+}
+
+#endif // WSSPI_NO_EXCEPTIONS
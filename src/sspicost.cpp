@@ -0,0 +1,214 @@
+//==============================================================================
+// File: 			    sspicost.cpp
+//
+// Description: 	implementation of our per-principal cost tracker
+//
+//==============================================================================
+// Copyright(C) 2000, Tomas Restrepo. All rights reserved
+// Send comments to: tomasr@mvps.org
+//==============================================================================
+
+#include "stdafx.h"
+
+using namespace WSSPI2;
+using namespace Winterdom::Runtime;
+
+// static objects
+CostTracker * volatile CostTracker::m_installed = 0;
+
+//! orders counters most expensive first
+static bool CostGreater ( const CostEntry & a, const CostEntry & b )
+{
+  return a.cost > b.cost;
+}
+
+
+CostTracker::CostTracker ( size_t capacity, cost_metric metric /*= ck_time*/ )
+  : m_capacity ( capacity ),
+    m_metric ( metric ),
+    m_total ( 0 )
+{
+  assert ( capacity > 0 );
+  m_heap.reserve ( capacity );
+}
+
+/**
+  Uninstalls the tracker, if it was installed. Make sure
+  no context is still charging to it by then.
+*/
+CostTracker::~CostTracker ( )
+{
+  InterlockedCompareExchangePointer (
+        (PVOID volatile*)&m_installed, 0, this
+      );
+}
+
+/**
+  Adds some work done for principal. Done by Context
+  for the installed tracker, but you can charge your
+  own costs too. If it runs out of memory, it throws
+  std::bad_alloc and the tracker is left as it was.
+*/
+void CostTracker::Charge (
+        const Principal * principal,
+        ULONG legs,
+        ULONGLONG ticks,
+        ULONGLONG bytes
+      )
+{
+  ULONGLONG cost = Measure ( legs, ticks, bytes );
+
+  Threading::CriticalSectionLock autolock(m_lock);
+  size_t i = 0;
+  cpmap::iterator it = m_pos.find ( principal );
+  if ( it != m_pos.end ( ) )
+  {
+    i = it->second;
+  }
+  else if ( m_heap.size ( ) < m_capacity )
+  {
+    // the only thing that allocates goes first
+    // (the heap has room for capacity counters)
+    CostEntry e = { principal, 0, 0, 0, 0, 0 };
+    i = m_heap.size ( );
+    m_pos[principal] = i;
+    m_heap.push_back ( e );
+    // a new counter is the smallest one
+    // there is, so it goes to the top
+    while ( i > 0 )
+    {
+      size_t parent = (i - 1) / 2;
+      std::swap ( m_heap[i], m_heap[parent] );
+      m_pos[m_heap[i].principal] = i;
+      m_pos[m_heap[parent].principal] = parent;
+      i = parent;
+    }
+  }
+  else
+  {
+    // take over the smallest counter
+    m_pos[principal] = 0;
+    CostEntry & e = m_heap[0];
+    m_pos.erase ( e.principal );
+    e.principal = principal;
+    e.error     = e.cost;
+    e.legs      = 0;
+    e.ticks     = 0;
+    e.bytes     = 0;
+  }
+
+  m_total += cost;
+  CostEntry & e = m_heap[i];
+  e.cost  += cost;
+  e.legs  += legs;
+  e.ticks += ticks;
+  e.bytes += bytes;
+  SiftDown ( i );
+}
+
+/**
+  Returns the (at most) k most expensive
+  principals, most expensive first
+*/
+std::vector<CostEntry> CostTracker::Top ( size_t k ) const
+{
+  cheap top;
+  {
+    Threading::CriticalSectionLock autolock(m_lock);
+    top = m_heap;
+  }
+  if ( k > top.size ( ) )
+    k = top.size ( );
+  std::partial_sort ( top.begin ( ), top.begin ( ) + k, top.end ( ), CostGreater );
+  top.resize ( k );
+  return top;
+}
+
+/**
+  Forgets everything counted so far
+*/
+void CostTracker::Reset ( )
+{
+  Threading::CriticalSectionLock autolock(m_lock);
+  m_heap.clear ( );
+  m_pos.clear ( );
+  m_total = 0;
+}
+
+/**
+  Returns the cost charged to all principals,
+  tracked or not
+*/
+ULONGLONG CostTracker::Total ( ) const
+{
+  Threading::CriticalSectionLock autolock(m_lock);
+  return m_total;
+}
+
+/**
+  Returns the number of principals being tracked
+*/
+size_t CostTracker::Size ( ) const
+{
+  Threading::CriticalSectionLock autolock(m_lock);
+  return m_heap.size ( );
+}
+
+/**
+  Makes tracker the one every Context charges to,
+  or turns accounting off if it's NULL. Returns
+  the one installed before.
+*/
+CostTracker * CostTracker::Install ( CostTracker * tracker )
+{
+  return (CostTracker*)InterlockedExchangePointer (
+                (PVOID volatile*)&m_installed, tracker
+              );
+}
+
+/**
+  Returns the tracker contexts charge to,
+  or NULL if accounting is off
+*/
+CostTracker * CostTracker::Installed ( )
+{
+  return m_installed;
+}
+
+/**
+  Returns the cost of some work in our metric
+*/
+ULONGLONG CostTracker::Measure ( ULONG legs, ULONGLONG ticks, ULONGLONG bytes ) const
+{
+  switch ( m_metric )
+  {
+  case ck_legs:   return legs;
+  case ck_bytes:  return bytes;
+  default:        return ticks;
+  }
+}
+
+/**
+  Moves the counter at i down the heap
+  after its cost grew
+*/
+void CostTracker::SiftDown ( size_t i )
+{
+  const size_t n = m_heap.size ( );
+  for ( ;; )
+  {
+    size_t least = i;
+    size_t l = 2 * i + 1;
+    size_t r = l + 1;
+    if ( l < n && m_heap[l].cost < m_heap[least].cost )
+      least = l;
+    if ( r < n && m_heap[r].cost < m_heap[least].cost )
+      least = r;
+    if ( least == i )
+      break;
+    std::swap ( m_heap[i], m_heap[least] );
+    m_pos[m_heap[i].principal] = i;
+    m_pos[m_heap[least].principal] = least;
+    i = least;
+  }
+}
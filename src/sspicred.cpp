@@ -29,6 +29,8 @@ Credentials::Credentials ( )
     m_use ( cu_both )
 {
   SecInvalidateHandle ( &m_hCred );
+  m_expiry.QuadPart = 0;
+  m_tok_stats[0] = m_tok_stats[1] = 0;
 }
 
 void Credentials::Initialize ( 
@@ -39,6 +41,7 @@ void Credentials::Initialize (
 {
   m_use = use;
   m_pkg = pkg;
+  m_tok_stats[0] = m_tok_stats[1] = 0;
   if ( target != 0 )
   {
     m_target = _tcsdup ( target );
@@ -178,15 +181,54 @@ DWORD Credentials::GetProtocols ( ) const
   else return 0;
 }
 
+/**
+  Returns when these credentials expire, as
+  reported by AcquireCredentialsHandle()
+*/
+TimeStamp Credentials::Expiration ( ) const
+{
+  return m_expiry;
+}
+
+/**
+  Returns the milliseconds left until these
+  credentials expire (INFINITE if they don't)
+*/
+DWORD Credentials::TimeToExpiry ( ) const
+{
+  return TimeLeft ( m_expiry );
+}
+
+/**
+  Returns the token and handshake statistics of
+  our package for the given side (see TokenSizes).
+  Only the first call looks them up.
+*/
+TokenStats * Credentials::HandshakeStats ( bool server ) const
+{
+  TokenStats * stats = m_tok_stats[server];
+  if ( stats == 0 )
+  {
+    // racing threads find the same record
+    stats = TokenSizes::Find ( m_pkg.NameStr ( ), server );
+    InterlockedExchangePointer ( (PVOID volatile*)&m_tok_stats[server], stats );
+  }
+  return stats;
+}
+
 //==============================================================================
 // NtCredentials implementation
 
 NtCredentials::NtCredentials (
         NtCredPkg pkg,
         Credentials::credentials_use use, 
-        const TCHAR * target /* = NULL */
+        const TCHAR * target /* = NULL */,
+        const TCHAR * packages /* = NULL */
       )
 {
+  // only Negotiate understands a package list
+  assert ( packages == NULL || pkg == nt_negotiate );
+
   const TCHAR * pkgname = 0;
   switch ( pkg )
   {
@@ -203,10 +245,19 @@ NtCredentials::NtCredentials (
   m_identity.UserLength        = 0;
   m_identity.Password          = NULL;
   m_identity.PasswordLength    = 0;
-  // we don't support passing in a possible list of packages
-  // when using Negotiate, you can implement it, though, if you like.
   m_identity.PackageList       = NULL;
   m_identity.PackageListLength = 0;
+#ifdef _UNICODE
+  m_identity.Flags             = SEC_WINNT_AUTH_IDENTITY_UNICODE;
+#else
+  m_identity.Flags             = SEC_WINNT_AUTH_IDENTITY_ANSI;
+#endif
+  if ( packages != NULL )
+  {
+    m_identity.PackageList       = USTR(_tcsdup ( packages ));
+    if ( m_identity.PackageList == NULL ) throwex ( err_no_memory );
+    m_identity.PackageListLength = _tcslen ( packages );
+  }
 }
 
 NtCredentials::~NtCredentials( )
@@ -217,6 +268,18 @@ NtCredentials::~NtCredentials( )
     free ( m_identity.User );
   if ( m_identity.Password != NULL )
     free ( m_identity.Password );
+  if ( m_identity.PackageList != NULL )
+    free ( m_identity.PackageList );
+}
+
+/**
+  Returns the identity to pass to AcquireCredentials()
+  when not using alternate credentials: none, unless
+  we need to restrict the Negotiate package list.
+*/
+SEC_WINNT_AUTH_IDENTITY_EX * NtCredentials::AuthIdentity ( )
+{
+  return (m_identity.PackageList != NULL) ? &m_identity : NULL;
 }
 
 /**
@@ -228,7 +291,7 @@ void NtCredentials::Acquire ( )
   SECURITY_STATUS     status;
   
   status = AcquireCredentials ( 
-                NULL, NULL, NULL,
+                NULL, NULL, AuthIdentity ( ),
                 NULL, NULL
               );
   if ( status != SEC_E_OK )
@@ -262,11 +325,6 @@ void NtCredentials::AcquireAlternate (
   m_identity.UserLength     = _tcslen ( user );
   m_identity.Password       = USTR(_tcsdup ( password ));
   m_identity.PasswordLength = _tcslen ( password );
-#ifdef _UNICODE
-  m_identity.Flags          = SEC_WINNT_AUTH_IDENTITY_UNICODE;
-#else
-  m_identity.Flags          = SEC_WINNT_AUTH_IDENTITY_ANSI;
-#endif
 
   status = AcquireCredentials ( 
                 NULL, NULL, 
@@ -288,7 +346,7 @@ void NtCredentials::AcquireAlternate ( const LUID * luid )
   status = AcquireCredentials ( 
                 NULL,
                 const_cast<LUID*>(luid),
-                NULL, NULL, NULL
+                AuthIdentity ( ), NULL, NULL
               );
   if ( status != SEC_E_OK )
     throwexe ( err_no_credentials, status );
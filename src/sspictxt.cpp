@@ -21,6 +21,68 @@ namespace {
   const ULONG CTXT_REQS = ISC_REQ_REPLAY_DETECT | ISC_REQ_SEQUENCE_DETECT 
                           | ISC_REQ_CONFIDENTIALITY | ISC_REQ_DELEGATE;
   const ULONG DATA_REP  = SECURITY_NATIVE_DREP;
+
+  // spans up to this count don't need a heap allocation
+  const size_t MAX_LOCAL_SPANS = 8;
+  // provider calls between charges to the CostTracker
+  const ULONG COST_BATCH = 32;
+  // last Context::Serial() handed out
+  volatile LONG g_serial = 0;
+
+  /**
+    Returns the size of the data buffers in bd
+  */
+  ULONG DataBytes ( PSecBufferDesc bd )
+  {
+    ULONG bytes = 0;
+    for ( ULONG i = 0; i < bd->cBuffers; i++ )
+    {
+      if ( (bd->pBuffers[i].BufferType & ~SECBUFFER_READONLY) == SECBUFFER_DATA )
+        bytes += bd->pBuffers[i].cbBuffer;
+    }
+    return bytes;
+  }
+
+  /**
+    Wraps an array of caller spans as user owned
+    Buffers, so they can be added to a BufferDesc.
+  */
+  class SpanBuffers
+  {
+  public:
+    SpanBuffers ( const MessageSpan * spans, size_t count )
+      : m_bufs ( m_local ),
+        m_count ( count )
+    {
+      assert ( spans != 0 );
+      assert ( count >= 1 );
+      if ( count > MAX_LOCAL_SPANS )
+      {
+        m_bufs = new Buffer[count];
+        if ( m_bufs == 0 ) throwex ( err_no_memory );
+      }
+      for ( size_t i = 0; i < count; i++ )
+      {
+        buffer_type type = bt_data;
+        if ( spans[i].read_only )
+          type = (buffer_type)(SECBUFFER_DATA | SECBUFFER_READONLY);
+        m_bufs[i].FromByteStream ( spans[i].data, spans[i].size, type );
+      }
+    }
+    ~SpanBuffers ( )
+    {
+      if ( m_bufs != m_local ) 
+        delete [] m_bufs;
+    }
+    void AddTo ( BufferDesc & bd )
+    {
+      bd.add ( m_bufs, m_count );
+    }
+  private:
+    Buffer   m_local[MAX_LOCAL_SPANS];
+    Buffer * m_bufs;
+    size_t   m_count;
+  };
 }
 
 Context::Context ( )
@@ -28,9 +90,23 @@ Context::Context ( )
     m_state ( as_continue ),
     m_cred ( 0 ),
     m_ctxt_reqs ( CTXT_REQS ),
-    m_data_rep ( DATA_REP )
+    m_data_rep ( DATA_REP ),
+    m_token_alloc ( ta_max_token ),
+    m_confirm_mode ( cm_round_trip ),
+    m_leg ( 0 ),
+    m_have_attrs ( false ),
+    m_ctxt_attr ( 0 ),
+    m_principal ( 0 ),
+    m_token ( 0 ),
+    m_hs_start ( 0 ),
+    m_stats_seq ( 0 ),
+    m_serial ( InterlockedIncrement ( &g_serial ) )
 {
   SecInvalidateHandle ( &m_hCtxt );
+  memset ( &m_cost, 0, sizeof(m_cost) );
+  memset ( &m_stats, 0, sizeof(m_stats) );
+  m_expiry.LowPart  = 0;
+  m_expiry.HighPart = 0;
 }
 
 /**
@@ -67,6 +143,17 @@ bool Context::IsValid ( ) const
   return (m_have_ctxt && m_state == as_ok);
 }
 
+/**
+  Returns a number that identifies this context until
+  it is freed: Free() gives it a new one, so it tells
+  apart contexts that share an address, or the same 
+  object reused.
+*/
+ULONG Context::Serial ( ) const
+{
+  return m_serial;
+}
+
 /**
   Returns a pointer to our context handle.
 */
@@ -88,6 +175,55 @@ void Context::SetWorkingParams ( ULONG ctxt_reqs, ULONG data_rep )
   m_data_rep  = data_rep;
 }
 
+/**
+  Selects how Authenticate() sizes the output token:
+  <ul>
+    <li>ta_max_token: always SecPkg::MaxTokenSize() (the default)
+    <li>ta_adaptive: from the sizes observed so far for this
+      package and leg (see TokenSizes), falling back to
+      SecPkg::MaxTokenSize() if the provider asks for more
+    <li>ta_provider: the provider allocates an exactly-sized
+      token, which is released with FreeContextBuffer()
+  </ul>
+*/
+void Context::SetTokenAllocation ( token_alloc mode )
+{
+  m_token_alloc = mode;
+}
+
+/**
+  Selects how the authentication result reaches the
+  client. Both sides must use the same mode.
+  <ul>
+    <li>cm_round_trip (the default): the client never
+      finishes on its own; it waits for the bt_confirmation
+      buffer built by ServerContext::ConfirmAuthentication().
+      This costs one extra network round trip.
+    <li>cm_optimistic: the client finishes as soon as its
+      provider says so. If the server produces a final 
+      token, the result is appended to it 
+      (bt_token_confirmation). If the server has nothing 
+      to send, ServerContext::ConfirmAuthentication() only
+      produces a buffer on failure; the client then sees 
+      that bt_confirmation in place of the first message
+      and DecryptMessage()/VerifySignature() throw 
+      err_auth_failed (SEC_E_LOGON_DENIED).
+  </ul>
+*/
+void Context::SetConfirmMode ( confirm_mode mode )
+{
+  m_confirm_mode = mode;
+}
+
+
+/**
+  Returns the number of authentication legs 
+  (calls to Authenticate()) this context has gone through.
+*/
+ULONG Context::Legs ( ) const
+{
+  return m_leg;
+}
 
 /**
   Releases this Context. This is very useful when you need
@@ -99,10 +235,28 @@ void Context::SetWorkingParams ( ULONG ctxt_reqs, ULONG data_rep )
 */
 void Context::Free ( )
 {
+  // don't leave this thread impersonating a dead context
+  if ( m_have_ctxt 
+       && static_cast<Context*>(ImpersonationScope::Current ( )) == this )
+  {
+    g_sspi->RevertSecurityContext ( &m_hCtxt );
+    ImpersonationScope::SetCurrent ( 0 );
+  }
+  m_serial = InterlockedIncrement ( &g_serial );
   g_sspi->DeleteSecurityContext ( &m_hCtxt );
   SecInvalidateHandle ( &m_hCtxt );
   m_have_ctxt = false;
   m_state = as_continue; 
+  m_leg = 0;
+  m_have_attrs = false;
+  m_ctxt_attr = 0;
+  ChargeCost ( );
+  m_principal = 0;
+  if ( m_token != 0 )
+    CloseHandle ( m_token );
+  m_token = 0;
+  m_expiry.LowPart  = 0;
+  m_expiry.HighPart = 0;
 }
 
 // == query attributes wrappers
@@ -115,12 +269,8 @@ void Context::Free ( )
 */
 ULONG Context::MaxTokenSize ( ) const
 {
-  SecPkgContext_Sizes sizes = { 0x0 };
-  SECURITY_STATUS status = 0;
-  status = QueryAttributes ( SECPKG_ATTR_SIZES, &sizes );
-  if ( status == SEC_E_OK )
-    return sizes.cbMaxToken;
-  else return 0;
+  SecPkgContext_Sizes tmp;
+  return Sizes ( tmp ).cbMaxToken;
 }
 
 /**
@@ -129,12 +279,8 @@ ULONG Context::MaxTokenSize ( ) const
 */
 ULONG Context::MaxSignatureSize ( ) const
 {
-  SecPkgContext_Sizes sizes = { 0x0 };
-  SECURITY_STATUS status = 0;
-  status = QueryAttributes ( SECPKG_ATTR_SIZES, &sizes );
-  if ( status == SEC_E_OK )
-    return sizes.cbMaxSignature;
-  else return 0;
+  SecPkgContext_Sizes tmp;
+  return Sizes ( tmp ).cbMaxSignature;
 }
 
 /**
@@ -145,12 +291,8 @@ ULONG Context::MaxSignatureSize ( ) const
 */
 ULONG Context::BlockSize ( ) const
 {
-  SecPkgContext_Sizes sizes = { 0x0 };
-  SECURITY_STATUS status = 0;
-  status = QueryAttributes ( SECPKG_ATTR_SIZES, &sizes );
-  if ( status == SEC_E_OK )
-    return sizes.cbBlockSize;
-  else return 0;
+  SecPkgContext_Sizes tmp;
+  return Sizes ( tmp ).cbBlockSize;
 }
 
 /**
@@ -159,12 +301,8 @@ ULONG Context::BlockSize ( ) const
 */
 ULONG Context::SecurityTrailerSize ( ) const
 {
-  SecPkgContext_Sizes sizes = { 0x0 };
-  SECURITY_STATUS status = 0;
-  status = QueryAttributes ( SECPKG_ATTR_SIZES, &sizes );
-  if ( status == SEC_E_OK )
-    return sizes.cbSecurityTrailer;
-  else return 0;
+  SecPkgContext_Sizes tmp;
+  return Sizes ( tmp ).cbSecurityTrailer;
 }
 
 /**
@@ -173,12 +311,8 @@ ULONG Context::SecurityTrailerSize ( ) const
 */
 ULONG Context::StreamHeaderSize ( ) const
 {
-  SecPkgContext_StreamSizes sizes = { 0x0 };
-  SECURITY_STATUS status = 0;
-  status = QueryAttributes ( SECPKG_ATTR_STREAM_SIZES, &sizes );
-  if ( status == SEC_E_OK )
-    return sizes.cbHeader;
-  else return 0;
+  SecPkgContext_StreamSizes tmp;
+  return StreamSizes ( tmp ).cbHeader;
 }
 
 /**
@@ -187,12 +321,8 @@ ULONG Context::StreamHeaderSize ( ) const
 */
 ULONG Context::StreamTrailerSize ( ) const
 {
-  SecPkgContext_StreamSizes sizes = { 0x0 };
-  SECURITY_STATUS status = 0;
-  status = QueryAttributes ( SECPKG_ATTR_STREAM_SIZES, &sizes );
-  if ( status == SEC_E_OK )
-    return sizes.cbTrailer;
-  else return 0;
+  SecPkgContext_StreamSizes tmp;
+  return StreamSizes ( tmp ).cbTrailer;
 }
 
 /**
@@ -201,12 +331,8 @@ ULONG Context::StreamTrailerSize ( ) const
 */
 ULONG Context::StreamMaxMessageSize ( ) const
 {
-  SecPkgContext_StreamSizes sizes = { 0x0 };
-  SECURITY_STATUS status = 0;
-  status = QueryAttributes ( SECPKG_ATTR_STREAM_SIZES, &sizes );
-  if ( status == SEC_E_OK )
-    return sizes.cbMaximumMessage;
-  else return 0;
+  SecPkgContext_StreamSizes tmp;
+  return StreamSizes ( tmp ).cbMaximumMessage;
 }
 
 /**
@@ -216,12 +342,8 @@ ULONG Context::StreamMaxMessageSize ( ) const
 */
 ULONG Context::StreamNumBuffers ( ) const
 {
-  SecPkgContext_StreamSizes sizes = { 0x0 };
-  SECURITY_STATUS status = 0;
-  status = QueryAttributes ( SECPKG_ATTR_STREAM_SIZES, &sizes );
-  if ( status == SEC_E_OK )
-    return sizes.cBuffers;
-  else return 0;
+  SecPkgContext_StreamSizes tmp;
+  return StreamSizes ( tmp ).cBuffers;
 }
 
 //    SecPkgContext_Names
@@ -231,6 +353,9 @@ ULONG Context::StreamNumBuffers ( ) const
 */
 wsstring Context::UserName ( ) const
 {
+  if ( m_have_attrs )
+    return m_attrs.user_name;
+
   SecPkgContext_Names names = { 0x0 };
   SECURITY_STATUS status = 0;
   status = QueryAttributes ( SECPKG_ATTR_NAMES, &names );
@@ -243,6 +368,17 @@ wsstring Context::UserName ( ) const
   return name;
 }
 
+/**
+  Returns the interned principal of the user this 
+  context represents, once the handshake is complete
+  (NULL before, or if the provider won't tell). Unlike
+  UserName(), it doesn't query or copy anything.
+*/
+const Principal * Context::GetPrincipal ( ) const
+{
+  return m_principal;
+}
+
 /**
   Returns the authority name used to establish this
   security context. Not all providers support this
@@ -268,17 +404,8 @@ wsstring Context::AuthorityName ( ) const
 */
 wsstring Context::SignatureAlgName ( ) const
 {
-  SecPkgContext_KeyInfo info = { 0x0 };
-  SECURITY_STATUS status = 0;
-  status = QueryAttributes ( SECPKG_ATTR_KEY_INFO, &info );
-  wsstring name = _T("");
-  if ( status == SEC_E_OK && info.sSignatureAlgorithmName != 0 )
-  {
-    name = info.sSignatureAlgorithmName;
-    g_sspi->FreeContextBuffer ( (void*)info.sSignatureAlgorithmName );
-    g_sspi->FreeContextBuffer ( (void*)info.sEncryptAlgorithmName );
-  }
-  return name;
+  key_info tmp;
+  return KeyInfo ( tmp ).sig_alg_name;
 }
 
 /**
@@ -287,17 +414,8 @@ wsstring Context::SignatureAlgName ( ) const
 */
 wsstring Context::EncryptAlgName ( ) const
 {
-  SecPkgContext_KeyInfo info = { 0x0 };
-  SECURITY_STATUS status = 0;
-  status = QueryAttributes ( SECPKG_ATTR_KEY_INFO, &info );
-  wsstring name = _T("");
-  if ( status == SEC_E_OK && info.sEncryptAlgorithmName != 0 )
-  {
-    name = info.sEncryptAlgorithmName;
-    g_sspi->FreeContextBuffer ( (void*)info.sSignatureAlgorithmName );
-    g_sspi->FreeContextBuffer ( (void*)info.sEncryptAlgorithmName );
-  }
-  return name;
+  key_info tmp;
+  return KeyInfo ( tmp ).enc_alg_name;
 }
 
 /**
@@ -306,16 +424,8 @@ wsstring Context::EncryptAlgName ( ) const
 */
 ULONG Context::KeySize ( ) const
 {
-  SecPkgContext_KeyInfo info = { 0x0 };
-  SECURITY_STATUS status = 0;
-  status = QueryAttributes ( SECPKG_ATTR_KEY_INFO, &info );
-  if ( status == SEC_E_OK )
-  {
-    g_sspi->FreeContextBuffer ( (void*)info.sSignatureAlgorithmName );
-    g_sspi->FreeContextBuffer ( (void*)info.sEncryptAlgorithmName );
-    return info.KeySize;
-  }
-  return 0;
+  key_info tmp;
+  return KeyInfo ( tmp ).key_size;
 }
 
 /**
@@ -323,32 +433,16 @@ ULONG Context::KeySize ( ) const
 */
 ALG_ID Context::SignatureAlgorithm ( ) const
 {
-  SecPkgContext_KeyInfo info = { 0x0 };
-  SECURITY_STATUS status = 0;
-  status = QueryAttributes ( SECPKG_ATTR_KEY_INFO, &info );
-  if ( status == SEC_E_OK )
-  {
-    g_sspi->FreeContextBuffer ( (void*)info.sSignatureAlgorithmName );
-    g_sspi->FreeContextBuffer ( (void*)info.sEncryptAlgorithmName );
-    return info.SignatureAlgorithm;
-  }
-  return 0;
+  key_info tmp;
+  return KeyInfo ( tmp ).sig_alg;
 }
 /**
   Returns the id of the encryption algorithm.
 */
 ALG_ID Context::EncryptAlgorithm ( ) const
 {
-  SecPkgContext_KeyInfo info = { 0x0 };
-  SECURITY_STATUS status = 0;
-  status = QueryAttributes ( SECPKG_ATTR_KEY_INFO, &info );
-  if ( status == SEC_E_OK )
-  {
-    g_sspi->FreeContextBuffer ( (void*)info.sSignatureAlgorithmName );
-    g_sspi->FreeContextBuffer ( (void*)info.sEncryptAlgorithmName );
-    return info.EncryptAlgorithm;
-  }
-  return 0;
+  key_info tmp;
+  return KeyInfo ( tmp ).enc_alg;
 }
 
 /**
@@ -357,6 +451,13 @@ ALG_ID Context::EncryptAlgorithm ( ) const
 */
 void Context::GetLifeSpan ( TimeStamp & start, TimeStamp & expiration ) const
 {
+  if ( m_have_attrs )
+  {
+    start      = m_attrs.start;
+    expiration = m_attrs.expiry;
+    return;
+  }
+
   start.LowPart  = expiration.LowPart  = 0;
   start.HighPart = expiration.HighPart = 0; 
 
@@ -370,55 +471,320 @@ void Context::GetLifeSpan ( TimeStamp & start, TimeStamp & expiration ) const
   }
 }
 
+/**
+  Returns the context attributes (ISC_RET_* flags on
+  the client side, ASC_RET_* on the server side) granted
+  by the provider on the last authentication leg. These tell
+  you which of the requested protections you actually got.
+*/
+ULONG Context::ContextAttributes ( ) const
+{
+  return m_ctxt_attr;
+}
+
+/**
+  Was message confidentiality (encryption) granted?
+*/
+bool Context::HasConfidentiality ( ) const
+{
+  const ULONG flag = IsServer ( ) ? ASC_RET_CONFIDENTIALITY : ISC_RET_CONFIDENTIALITY;
+  return ((m_ctxt_attr & flag) != 0);
+}
+
+/**
+  Was message integrity (signing) granted?
+  Notice the client and server flags differ here.
+*/
+bool Context::HasIntegrity ( ) const
+{
+  const ULONG flag = IsServer ( ) ? ASC_RET_INTEGRITY : ISC_RET_INTEGRITY;
+  return ((m_ctxt_attr & flag) != 0);
+}
+
+/**
+  Was replay detection granted?
+*/
+bool Context::HasReplayDetect ( ) const
+{
+  const ULONG flag = IsServer ( ) ? ASC_RET_REPLAY_DETECT : ISC_RET_REPLAY_DETECT;
+  return ((m_ctxt_attr & flag) != 0);
+}
+
+/**
+  Was out of sequence detection granted?
+*/
+bool Context::HasSequenceDetect ( ) const
+{
+  const ULONG flag = IsServer ( ) ? ASC_RET_SEQUENCE_DETECT : ISC_RET_SEQUENCE_DETECT;
+  return ((m_ctxt_attr & flag) != 0);
+}
+
+/**
+  Returns the context expiration time, as returned 
+  by Initialize/AcceptSecurityContext (local time).
+  It's 0 until the first authentication leg.
+*/
+TimeStamp Context::Expiration ( ) const
+{
+  return m_expiry;
+}
+
+/**
+  Returns the milliseconds left until the context 
+  expires: 0 if it already has, INFINITE if it
+  never does (or not within 49 days).
+*/
+DWORD Context::TimeToExpiry ( ) const
+{
+  return TimeLeft ( m_expiry );
+}
+
+/**
+  Returns the SECPKG_ATTR_SIZES of this context, from 
+  the attribute snapshot if we have one, or else queried
+  into tmp. On failure, all sizes are 0.
+*/
+const SecPkgContext_Sizes & Context::Sizes ( SecPkgContext_Sizes & tmp ) const
+{
+  if ( m_have_attrs )
+    return m_attrs.sizes;
+
+  memset ( &tmp, 0, sizeof(tmp) );
+  if ( QueryAttributes ( SECPKG_ATTR_SIZES, &tmp ) != SEC_E_OK )
+    memset ( &tmp, 0, sizeof(tmp) );
+  return tmp;
+}
+
+/**
+  Returns the SECPKG_ATTR_STREAM_SIZES of this context,
+  from the attribute snapshot if we have one, or else
+  queried into tmp. On failure, all sizes are 0.
+*/
+const SecPkgContext_StreamSizes & 
+Context::StreamSizes ( SecPkgContext_StreamSizes & tmp ) const
+{
+  if ( m_have_attrs )
+    return m_attrs.stream_sizes;
+
+  memset ( &tmp, 0, sizeof(tmp) );
+  if ( QueryAttributes ( SECPKG_ATTR_STREAM_SIZES, &tmp ) != SEC_E_OK )
+    memset ( &tmp, 0, sizeof(tmp) );
+  return tmp;
+}
+
+/**
+  Returns the SECPKG_ATTR_KEY_INFO of this context,
+  from the attribute snapshot if we have one, or else
+  queried into tmp. On failure, everything is 0/empty.
+*/
+const Context::key_info & Context::KeyInfo ( key_info & tmp ) const
+{
+  if ( m_have_attrs )
+    return m_attrs.key;
+
+  tmp.key_size = 0;
+  tmp.sig_alg  = 0;
+  tmp.enc_alg  = 0;
+
+  SecPkgContext_KeyInfo info = { 0x0 };
+  SECURITY_STATUS status = 0;
+  status = QueryAttributes ( SECPKG_ATTR_KEY_INFO, &info );
+  if ( status == SEC_E_OK )
+  {
+    tmp.key_size = info.KeySize;
+    tmp.sig_alg  = info.SignatureAlgorithm;
+    tmp.enc_alg  = info.EncryptAlgorithm;
+    if ( info.sSignatureAlgorithmName != 0 )
+      tmp.sig_alg_name = info.sSignatureAlgorithmName;
+    if ( info.sEncryptAlgorithmName != 0 )
+      tmp.enc_alg_name = info.sEncryptAlgorithmName;
+    g_sspi->FreeContextBuffer ( (void*)info.sSignatureAlgorithmName );
+    g_sspi->FreeContextBuffer ( (void*)info.sEncryptAlgorithmName );
+  }
+  return tmp;
+}
+
+/**
+  Takes a snapshot of the context attributes that 
+  don't change once the context is established 
+  (sizes, stream sizes, key info, user name and lifespan),
+  so that the query wrappers don't have to call
+  QueryContextAttributes() each time.
+*/
+void Context::CacheAttributes ( )
+{
+  m_have_attrs = false;
+
+  Sizes ( m_attrs.sizes );
+  StreamSizes ( m_attrs.stream_sizes );
+  m_attrs.key.sig_alg_name.erase ( );
+  m_attrs.key.enc_alg_name.erase ( );
+  KeyInfo ( m_attrs.key );
+  m_attrs.user_name = UserName ( );
+  GetLifeSpan ( m_attrs.start, m_attrs.expiry );
+  m_principal = m_attrs.user_name.empty ( ) 
+              ? 0 : PrincipalTable::Intern ( m_attrs.user_name );
+
+  m_have_attrs = true;
+}
+
 // == message security ==
 /**
   Encrypts a message with this security context.
+  If the provider wants the context renegotiated first,
+  this throws err_encrypt_failed with SEC_I_RENEGOTIATE,
+  leaving the context valid; use TryEncryptMessage() to
+  handle that without an exception.
 */
 void Context::EncryptMessage ( ULONG qop, BufferDesc & msg, ULONG seq_num /*= 0*/ )
 {
   if ( g_sspi->EncryptMessage == 0 ) 
     throwex ( err_no_sec_interface );
 
-  SECURITY_STATUS status = 0;
-  status = g_sspi->EncryptMessage ( 
-                &m_hCtxt,
-                qop,
-                msg.get_bd ( ),
-                seq_num
-              );
+  SECURITY_STATUS status = TryEncryptMessage ( qop, msg, seq_num );
   if ( status != SEC_E_OK )
-  {
-    if ( status == SEC_I_RENEGOTIATE )
-      Free ( );
     throwexe ( err_encrypt_failed, status );
-  }
-  msg.update ( );
 } //EncryptMessage()
 
+/**
+  Like EncryptMessage(), but failures are returned
+  instead of thrown: SEC_E_OK, SEC_I_RENEGOTIATE (the 
+  message is left alone) or the provider's error code.
+  Use this on paths where failing is expected and 
+  unwinding an exception would cost more than the call.
+*/
+SECURITY_STATUS Context::TryEncryptMessage ( ULONG qop, BufferDesc & msg, ULONG seq_num /*= 0*/ ) throw()
+{
+  if ( g_sspi->EncryptMessage == 0 ) 
+    return SEC_E_UNSUPPORTED_FUNCTION;
+  PSecBufferDesc bd = msg.try_get_bd ( );
+  if ( bd == 0 )
+    return SEC_E_INSUFFICIENT_MEMORY;
+
+  ULONGLONG start = Clock ( );
+  SECURITY_STATUS status = g_sspi->EncryptMessage ( &m_hCtxt, qop, bd, seq_num );
+  Account ( so_encrypt, start, status, bd );
+  if ( status == SEC_E_OK )
+    msg.update ( );
+  return status;
+} // TryEncryptMessage()
+
+/**
+  Encrypts a message held in a MessageFrame, in place.
+  On return, frame.WireData() and frame.WireSize() describe 
+  the record ready to be sent.
+*/
+void Context::EncryptMessage ( ULONG qop, MessageFrame & frame, ULONG seq_num /*= 0*/ )
+{
+  EncryptMessage ( qop, frame.Desc ( ), seq_num );
+  frame.Seal ( );
+} // EncryptMessage()
+
+/**
+  Like EncryptMessage(), for a MessageFrame. The frame
+  is only sealed if SEC_E_OK is returned.
+*/
+SECURITY_STATUS Context::TryEncryptMessage ( ULONG qop, MessageFrame & frame, ULONG seq_num /*= 0*/ ) throw()
+{
+  SECURITY_STATUS status = TryEncryptMessage ( qop, frame.Desc ( ), seq_num );
+  if ( status == SEC_E_OK )
+    frame.Seal ( );
+  return status;
+} // TryEncryptMessage()
+
+/**
+  Encrypts a message scattered across several caller
+  buffers, in place, without first copying it into a 
+  single Buffer. The library allocates header and trailer:
+  <ul>
+    <li>stream contexts: header is the STREAM_HEADER and 
+      trailer the STREAM_TRAILER. Note schannel only supports
+      a single data buffer per message.
+    <li>message contexts: header is the security TOKEN and 
+      trailer the PADDING.
+  </ul>
+  Send header, the spans and trailer, in that order.
+*/
+void Context::EncryptMessage ( 
+        ULONG qop, const MessageSpan * spans, size_t count,
+        Buffer & header, Buffer & trailer, ULONG seq_num /*= 0*/
+      )
+{
+  ULONG hsize = StreamHeaderSize ( );
+  ULONG tsize = StreamTrailerSize ( );
+  bool stream = (hsize != 0 || tsize != 0);
+  if ( stream )
+  {
+    header.Allocate ( hsize, bt_stream_header );
+    trailer.Allocate ( tsize, bt_stream_trailer );
+  }
+  else
+  {
+    header.Allocate ( SecurityTrailerSize ( ), bt_token );
+    trailer.Allocate ( BlockSize ( ), bt_padding );
+  }
+
+  SpanBuffers data ( spans, count );
+  Buffer empty;
+  BufferDesc bd;
+  bd.add ( &header );
+  data.AddTo ( bd );
+  bd.add ( &trailer );
+  if ( stream )
+    bd.add ( &empty );
+  EncryptMessage ( qop, bd, seq_num );
+} // EncryptMessage()
+
 /**
   Decrypts a message with this security context.
+  If the peer started a renegotiation, this throws 
+  err_decrypt_failed with SEC_I_RENEGOTIATE; see 
+  TryDecryptMessage() for keeping the session.
 */
 void Context::DecryptMessage ( ULONG & qop, BufferDesc & msg, ULONG seq_num /*= 0*/ )
 {
   if ( g_sspi->DecryptMessage == 0 ) 
     throwex ( err_no_sec_interface );
+  SECURITY_STATUS status = CheckConfirmation ( msg );
+  if ( status != SEC_E_OK )
+    throwexe ( (status == SEC_E_LOGON_DENIED) ? err_auth_failed : err_decrypt_failed,
+               status );
 
-  SECURITY_STATUS status = 0;
-  status = g_sspi->DecryptMessage ( 
-                &m_hCtxt,
-                msg.get_bd ( ),
-                seq_num,
-                &qop
-              );
+  status = TryDecryptMessage ( qop, msg, seq_num );
   if ( status != SEC_E_OK )
-  {
-    if ( status == SEC_I_RENEGOTIATE )
-      Free ( );
     throwexe ( err_decrypt_failed, status );
-  }
-  msg.update ( );
 } // DecryptMessage()
 
+/**
+  Like DecryptMessage(), but failures are returned
+  instead of thrown: SEC_E_OK, SEC_I_RENEGOTIATE or
+  the error code. An optimistic denial from the server
+  comes back as SEC_E_LOGON_DENIED.
+
+  On SEC_I_RENEGOTIATE the context stays valid, and the
+  bt_extra buffer in msg (if any) holds the peer's
+  token. Call Renegotiate() and go back to Authenticate()
+  with it; the session survives.
+*/
+SECURITY_STATUS Context::TryDecryptMessage ( ULONG & qop, BufferDesc & msg, ULONG seq_num /*= 0*/ ) throw()
+{
+  if ( g_sspi->DecryptMessage == 0 ) 
+    return SEC_E_UNSUPPORTED_FUNCTION;
+  SECURITY_STATUS status = CheckConfirmation ( msg );
+  if ( status != SEC_E_OK )
+    return status;
+  PSecBufferDesc bd = msg.try_get_bd ( );
+  if ( bd == 0 )
+    return SEC_E_INSUFFICIENT_MEMORY;
+
+  ULONGLONG start = Clock ( );
+  status = g_sspi->DecryptMessage ( &m_hCtxt, bd, seq_num, &qop );
+  Account ( so_decrypt, start, status, bd );
+  if ( status == SEC_E_OK || status == SEC_I_RENEGOTIATE )
+    msg.update ( );
+  return status;
+} // TryDecryptMessage()
+
 // == signature support ==
 /**
   Signs a message with this security context.
@@ -428,16 +794,47 @@ void Context::MakeSignature ( ULONG qop, BufferDesc & msg, ULONG seq_num /*= 0*/
   if ( g_sspi->MakeSignature == 0 ) 
     throwex ( err_no_sec_interface );
 
-  SECURITY_STATUS status = 0;
-  status = g_sspi->MakeSignature ( 
-                &m_hCtxt,
-                qop,
-                msg.get_bd ( ),
-                seq_num
-              );
+  SECURITY_STATUS status = TryMakeSignature ( qop, msg, seq_num );
   if ( status != SEC_E_OK )
     throwexe ( err_encrypt_failed, status );
-  msg.update ( );
+} // MakeSignature()
+
+/**
+  Like MakeSignature(), but returns the 
+  status instead of throwing.
+*/
+SECURITY_STATUS Context::TryMakeSignature ( ULONG qop, BufferDesc & msg, ULONG seq_num /*= 0*/ ) throw()
+{
+  if ( g_sspi->MakeSignature == 0 ) 
+    return SEC_E_UNSUPPORTED_FUNCTION;
+  PSecBufferDesc bd = msg.try_get_bd ( );
+  if ( bd == 0 )
+    return SEC_E_INSUFFICIENT_MEMORY;
+
+  ULONGLONG start = Clock ( );
+  SECURITY_STATUS status = g_sspi->MakeSignature ( &m_hCtxt, qop, bd, seq_num );
+  Account ( so_sign, start, status, bd );
+  if ( status == SEC_E_OK )
+    msg.update ( );
+  return status;
+} // TryMakeSignature()
+
+/**
+  Signs a message scattered across several caller
+  buffers. The signature is allocated by the library.
+*/
+void Context::MakeSignature ( 
+        ULONG qop, const MessageSpan * spans, size_t count,
+        Buffer & signature, ULONG seq_num /*= 0*/
+      )
+{
+  signature.Allocate ( MaxSignatureSize ( ), bt_token );
+
+  SpanBuffers data ( spans, count );
+  BufferDesc bd;
+  data.AddTo ( bd );
+  bd.add ( &signature );
+  MakeSignature ( qop, bd, seq_num );
 } // MakeSignature()
 
 //
@@ -450,17 +847,58 @@ void Context::VerifySignature ( ULONG & qop, BufferDesc & msg, ULONG seq_num /*=
 {
   if ( g_sspi->VerifySignature == 0 ) 
     throwex ( err_no_sec_interface );
+  SECURITY_STATUS status = CheckConfirmation ( msg );
+  if ( status != SEC_E_OK )
+    throwexe ( (status == SEC_E_LOGON_DENIED) ? err_auth_failed : err_encrypt_failed,
+               status );
 
-  SECURITY_STATUS status = 0;
-  status = g_sspi->VerifySignature ( 
-                &m_hCtxt,
-                msg.get_bd ( ),
-                seq_num,
-                &qop
-              );
+  status = TryVerifySignature ( qop, msg, seq_num );
   if ( status != SEC_E_OK )
     throwexe ( err_encrypt_failed, status );
-  msg.update ( );
+} // VerifySignature()
+
+/**
+  Like VerifySignature(), but returns the status
+  instead of throwing. A tampered message comes back 
+  as SEC_E_MESSAGE_ALTERED, an optimistic denial from
+  the server as SEC_E_LOGON_DENIED.
+*/
+SECURITY_STATUS Context::TryVerifySignature ( ULONG & qop, BufferDesc & msg, ULONG seq_num /*= 0*/ ) throw()
+{
+  if ( g_sspi->VerifySignature == 0 ) 
+    return SEC_E_UNSUPPORTED_FUNCTION;
+  SECURITY_STATUS status = CheckConfirmation ( msg );
+  if ( status != SEC_E_OK )
+    return status;
+  PSecBufferDesc bd = msg.try_get_bd ( );
+  if ( bd == 0 )
+    return SEC_E_INSUFFICIENT_MEMORY;
+
+  ULONGLONG start = Clock ( );
+  status = g_sspi->VerifySignature ( &m_hCtxt, bd, seq_num, &qop );
+  Account ( so_verify, start, status, bd );
+  if ( status == SEC_E_OK )
+    msg.update ( );
+  return status;
+} // TryVerifySignature()
+
+/**
+  Verifies the signature of a message scattered 
+  across several caller buffers.
+*/
+void Context::VerifySignature ( 
+        ULONG & qop, const MessageSpan * spans, size_t count,
+        Buffer & signature, ULONG seq_num /*= 0*/
+      )
+{
+  assert ( signature.IsValid ( ) );
+  signature.SetType ( bt_token );
+
+  SpanBuffers data ( spans, count );
+  BufferDesc bd;
+  data.AddTo ( bd );
+  bd.add ( &signature );
+  VerifySignature ( qop, bd, seq_num );
 } // VerifySignature()
 
 
@@ -468,55 +906,67 @@ void Context::VerifySignature ( ULONG & qop, BufferDesc & msg, ULONG seq_num /*=
 /**
   Imports a security context exported remotely by 
   Context::Export(). If this is a valid security context
-  already, we release it.
+  already, we release it. Pass the token Export() gave
+  you (duplicated into this process) so the context can
+  impersonate; without it, it's only good for message
+  protection. The token handle is still yours to close.
 */
-void Context::Import ( Buffer & ctxt )
+void Context::Import ( Buffer & ctxt, HANDLE token /*= NULL*/ )
 {
   assert ( ctxt.Size( ) != 0 );
 
   // make sure we don't leak a context!
   Free ( );
 
-  // copy string to a buffer
-  // yuck!
-  wsstring name = m_cred->Package().Name ( );
-  TCHAR * str = new TCHAR[name.size()+1];
-  if ( str == 0 ) throwex ( err_no_memory );
-  _tcscpy ( str, name.c_str() );
-
   SECURITY_STATUS status = 0;
   status = g_sspi->ImportSecurityContext (
-                str,
+                const_cast<TCHAR*>(m_cred->Package().NameStr ( )),
                 ctxt.GetSecBuffer ( ),
-                NULL,
+                token,
                 &m_hCtxt
               );
 
-  delete [] str;
   if ( status != SEC_E_OK )
     throwexe ( err_import_failed, status );
   m_have_ctxt = true;
+  // the context was established on the other side
+  m_state = as_ok;
+  CacheAttributes ( );
+
+  // we didn't go through the handshake, so ask
+  // the provider what was negotiated
+  SecPkgContext_Flags flags = { 0x0 };
+  if ( QueryAttributes ( SECPKG_ATTR_FLAGS, &flags ) == SEC_E_OK )
+    m_ctxt_attr = flags.Flags;
+  m_expiry = m_attrs.expiry;
 } // Import()
 
 /**
   Exports this security context into a buffer, which
-  can be later recreated by Context::Import().
+  can be later recreated by Context::Import(). If token
+  isn't NULL, it receives a handle to the context's 
+  token (server contexts only), which you must close
+  with CloseHandle().
 */
-void Context::Export ( Buffer & ctxt )
+void Context::Export ( Buffer & ctxt, HANDLE * token /*= 0*/ )
 {
   assert ( IsValid ( ) );
 
   // the buffer should be empty
   ctxt.Free ( );
-  ctxt.SetOwner ( bo_sspi );
+  if ( token != 0 )
+    *token = NULL;
 
   SECURITY_STATUS status = 0;
   status = g_sspi->ExportSecurityContext (
                 &m_hCtxt, 0,
                 ctxt.GetSecBuffer ( ),
-                NULL                    
+                token
               );
 
+  // the provider allocated the blob, so it's released
+  // with FreeContextBuffer()
+  ctxt.SetOwner ( bo_sspi );
   if ( status != SEC_E_OK )
     throwexe ( err_export_failed, status );
 } // Export()
@@ -562,6 +1012,18 @@ HANDLE Context::QueryToken ( )
   return hToken;
 }
 
+/**
+  Like QueryToken(), but the token is queried once
+  and kept: it belongs to the context, and is closed 
+  by Free(). Don't close it yourself.
+*/
+HANDLE Context::Token ( )
+{
+  if ( m_token == 0 )
+    m_token = QueryToken ( );
+  return m_token;
+}
+
 // == authentication ==
 /**
   This is the core functionality of SSPI:
@@ -570,6 +1032,57 @@ HANDLE Context::QueryToken ( )
   a security context.
 */
 auth_state Context::Authenticate ( Buffer * in, Buffer * out )
+{
+  auth_state state = as_error;
+  SECURITY_STATUS status = AuthenticateLeg ( in, out, state );
+  if ( state == as_error )
+    throwexe ( err_auth_failed, status );
+  return state;
+}
+
+/**
+  Like Authenticate(), but a failed leg is reported 
+  through the returned status (with state set to
+  as_error) instead of being thrown. A denied logon 
+  returns SEC_E_LOGON_DENIED, with state as_denied.
+  Servers facing the network can use this to turn away
+  bad tokens without unwinding an exception for each.
+  Running out of memory is reported as 
+  SEC_E_INSUFFICIENT_MEMORY (or goes to SspiEx::Fail()
+  in WSSPI_NO_EXCEPTIONS builds).
+*/
+SECURITY_STATUS Context::TryAuthenticate ( Buffer * in, Buffer * out, auth_state & state ) throw()
+{
+#ifdef WSSPI_NO_EXCEPTIONS
+  return AuthenticateLeg ( in, out, state );
+#else
+  SECURITY_STATUS status = SEC_E_INSUFFICIENT_MEMORY;
+  try {
+    return AuthenticateLeg ( in, out, state );
+#ifndef WSSPI_EX_THROW_NEW
+  } catch ( SspiEx & e ) {
+    if ( e.Win32Err ( ) != 0 )
+      status = e.Win32Err ( );
+#else
+  } catch ( SspiEx * e ) {
+    if ( e->Win32Err ( ) != 0 )
+      status = e->Win32Err ( );
+    e->Free ( );
+#endif
+  } catch ( ... ) {
+    // std::bad_alloc
+  }
+  m_state = as_error;
+  state   = m_state;
+  return status;
+#endif
+}
+
+/**
+  Does the work of Authenticate() and TryAuthenticate():
+  a failed leg is returned, anything else is thrown
+*/
+SECURITY_STATUS Context::AuthenticateLeg ( Buffer * in, Buffer * out, auth_state & state )
 {
   assert ( out != 0 );
   assert ( m_cred != 0 );
@@ -581,20 +1094,56 @@ auth_state Context::Authenticate ( Buffer * in, Buffer * out )
   if ( in != 0 )
     ibd.add ( in );
   obd.add ( out );
-  out->Allocate ( m_cred->Package().MaxTokenSize ( ), bt_token );
+
+  const ULONG max_token = m_cred->Package ( ).MaxTokenSize ( );
+  TokenStats * stats = m_cred->HandshakeStats ( IsServer ( ) );
+  switch ( m_token_alloc )
+  {
+  case ta_provider:
+    // CreateContext() asks the provider to allocate it
+    out->SetOwner ( bo_user );
+    out->SetType ( bt_token );
+    break;
+  case ta_adaptive:
+    out->Allocate ( TokenSizes::Hint ( stats, m_leg, max_token ), bt_token );
+    break;
+  default:
+    out->Allocate ( max_token, bt_token );
+    break;
+  }
 
   SECURITY_STATUS status = 0;
-  status = CreateContext ( 
-                m_have_ctxt ? &m_hCtxt : NULL,
-                (in != 0 ) ? ibd.get_bd ( ) : NULL,
-                &m_hCtxt,
-                obd.get_bd ( )
-              );
+  PSecBufferDesc  pobd   = 0;
+  ULONGLONG       start  = Clock ( );
+  for ( ;; )
+  {
+    pobd = obd.get_bd ( );
+    status = CreateContext ( 
+                  m_have_ctxt ? &m_hCtxt : NULL,
+                  (in != 0 ) ? ibd.get_bd ( ) : NULL,
+                  &m_hCtxt,
+                  pobd
+                );
+    // if our guess was too small, go again with
+    // the package maximum, which is always enough
+    if ( status != SEC_E_BUFFER_TOO_SMALL 
+         || m_token_alloc != ta_adaptive || out->Size ( ) >= max_token )
+      break;
+    out->Allocate ( max_token, bt_token );
+  }
+  Account ( so_leg, start, status, 0 );
+  if ( m_token_alloc == ta_provider )
+  {
+    // the token (if any) now belongs to the provider
+    out->GetSecBuffer ( )->pvBuffer = pobd->pBuffers[0].pvBuffer;
+    out->SetSize ( pobd->pBuffers[0].cbBuffer );
+    out->SetOwner ( bo_sspi );
+  }
   if ( (status == SEC_I_COMPLETE_NEEDED) ||
        (status == SEC_I_COMPLETE_AND_CONTINUE) )
   {
     if ( g_sspi->CompleteAuthToken != NULL )
-      g_sspi->CompleteAuthToken ( &m_hCtxt, obd.get_bd ( ) );
+      g_sspi->CompleteAuthToken ( &m_hCtxt, pobd );
   }
   
   switch ( status )
@@ -612,18 +1161,231 @@ auth_state Context::Authenticate ( Buffer * in, Buffer * out )
     break;
   default:
     m_state = as_error;
-    throwexe ( err_auth_failed, status );
+    state   = m_state;
+    ChargeCost ( );
+    return status;
   }
   // we now have a security context
   m_have_ctxt = true;
   obd.update ( );
-  return m_state;
+  if ( m_state == as_ok )
+    CacheAttributes ( );
+  TokenSizes::Record ( stats, m_leg++, out->Size ( ) );
+  if ( m_state != as_continue )
+  {
+    HandshakeLegs::Record ( stats, m_leg );
+    ChargeCost ( );
+  }
+  if ( m_state == as_ok && out->IsValid ( ) 
+       && m_confirm_mode == cm_optimistic && IsServer ( ) )
+    PiggybackConfirmation ( *out );
+  state = m_state;
+  return status;
+}
+
+/**
+  Gets an established context ready to go through 
+  Authenticate() again, keeping its handle, as stream 
+  packages (schannel) require after SEC_I_RENEGOTIATE
+  or to refresh keys. Message packages (NTLM, Kerberos)
+  can't renegotiate in place: authenticate a new
+  context instead, and switch over once it's done.
+*/
+void Context::Renegotiate ( )
+{
+  assert ( IsValid ( ) );
+  m_state      = as_continue;
+  m_leg        = 0;
+  m_have_attrs = false;
+}
+
+/**
+  Returns a snapshot of the counters for this context.
+  It never blocks the thread using the context, and can
+  be taken from any thread: if that thread updates the
+  counters while we copy them, we simply copy again.
+  Times are in QueryPerformanceCounter() units.
+*/
+ContextStats Context::Stats ( ) const
+{
+  ContextStats snap;
+  for ( ;; )
+  {
+    LONG seq = InterlockedCompareExchange ( &m_stats_seq, 0, 0 );
+    if ( (seq & 1) == 0 )
+    {
+      snap = m_stats;
+      if ( InterlockedCompareExchange ( &m_stats_seq, 0, 0 ) == seq )
+        return snap;
+    }
+    Sleep ( 0 );
+  }
+}
+
+/**
+  Zeroes the counters, say, before handing the 
+  context over to a new connection. Call it only 
+  from the thread using the context.
+*/
+void Context::ResetStats ( )
+{
+  InterlockedIncrement ( &m_stats_seq );
+  memset ( &m_stats, 0, sizeof(m_stats) );
+  InterlockedIncrement ( &m_stats_seq );
+}
+
+/**
+  Returns the time, to measure provider calls with
+*/
+ULONGLONG Context::Clock ( )
+{
+  LARGE_INTEGER now;
+  QueryPerformanceCounter ( &now );
+  return now.QuadPart;
+}
+
+/**
+  Accounts for a provider call started at start 
+  (see Clock()) that returned status, having gone
+  through the data in bd. Updates our counters and,
+  if there's a CostTracker, the costs we haven't 
+  charged yet.
+*/
+void Context::Account ( stat_op op, ULONGLONG start, SECURITY_STATUS status, PSecBufferDesc bd )
+{
+  ULONGLONG now   = Clock ( );
+  ULONGLONG ticks = now - start;
+  ULONG     bytes = (bd != 0) ? DataBytes ( bd ) : 0;
+  bool      ok    = (status == SEC_E_OK || status == SEC_I_RENEGOTIATE);
+  bool      more  = (status == SEC_I_CONTINUE_NEEDED 
+                     || status == SEC_I_COMPLETE_AND_CONTINUE);
+
+  // only the thread using the context writes the counters;
+  // an odd sequence tells Stats() we're halfway through
+  InterlockedIncrement ( &m_stats_seq );
+  m_stats.provider_ticks += ticks;
+  switch ( op )
+  {
+  case so_encrypt:
+    m_stats.msgs_encrypted += ok;
+    m_stats.bytes_encrypted += ok ? bytes : 0;
+    break;
+  case so_decrypt:
+    m_stats.msgs_decrypted += ok;
+    m_stats.bytes_decrypted += ok ? bytes : 0;
+    break;
+  case so_sign:
+    m_stats.msgs_signed += ok;
+    m_stats.bytes_signed += ok ? bytes : 0;
+    break;
+  case so_verify:
+    m_stats.msgs_verified += ok;
+    m_stats.bytes_verified += ok ? bytes : 0;
+    break;
+  case so_leg:
+    ok = more || status == SEC_E_OK || status == SEC_I_COMPLETE_NEEDED;
+    if ( m_leg == 0 )
+      m_hs_start = start;
+    m_stats.legs++;
+    if ( !more )
+    {
+      m_stats.handshakes++;
+      m_stats.handshake_ticks += now - m_hs_start;
+    }
+    break;
+  }
+  m_stats.failures += !ok;
+  InterlockedIncrement ( &m_stats_seq );
+
+  if ( CostTracker::Installed ( ) == 0 )
+    return;
+  m_cost.ticks += ticks;
+  m_cost.legs  += (op == so_leg);
+  m_cost.bytes += bytes;
+  if ( ++m_cost.calls >= COST_BATCH )
+    ChargeCost ( );
+}
+
+/**
+  Charges the costs added up so far to our
+  principal (NULL until the handshake is done)
+*/
+void Context::ChargeCost ( )
+{
+  if ( m_cost.calls == 0 )
+    return;
+  CostTracker * tracker = CostTracker::Installed ( );
+  if ( tracker != 0 )
+  {
+#ifndef WSSPI_NO_EXCEPTIONS
+    // the Try* methods get here, so we mustn't throw;
+    // Charge() only fails if it runs out of memory
+    try {
+      tracker->Charge ( m_principal, m_cost.legs, m_cost.ticks, m_cost.bytes );
+    } catch ( ... ) {
+    }
+#else
+    tracker->Charge ( m_principal, m_cost.legs, m_cost.ticks, m_cost.bytes );
+#endif
+  }
+  memset ( &m_cost, 0, sizeof(m_cost) );
+}
+
+/**
+  Appends our authentication state to the server's
+  final token, so the client doesn't need to wait for
+  a separate confirmation.
+*/
+void Context::PiggybackConfirmation ( Buffer & token )
+{
+  Buffer copy ( token );
+  DWORD size = copy.Size ( );
+  token.Allocate ( size + sizeof(auth_state), bt_token_confirmation );
+  BYTE * p = token.GetBufferForRecv ( );
+  memcpy ( p, copy.ByteStream ( ), size );
+  memcpy ( p + size, &m_state, sizeof(m_state) );
+}
+
+/**
+  In cm_optimistic mode, the server reports a failed
+  authentication by sending a bt_confirmation where the
+  client expects its first message. Check for that, and
+  return SEC_E_LOGON_DENIED if it is a denial, or
+  SEC_E_INVALID_TOKEN if it is too short to be one.
+*/
+SECURITY_STATUS Context::CheckConfirmation ( BufferDesc & msg )
+{
+  if ( m_confirm_mode != cm_optimistic || msg.size ( ) == 0 )
+    return SEC_E_OK;
+  const Buffer * buf = msg[0];
+  if ( buf->Type ( ) != bt_confirmation )
+    return SEC_E_OK;
+  // the type comes from the peer, so the size may lie
+  if ( buf->Size ( ) < sizeof(auth_state) || buf->ByteStream ( ) == 0 )
+    return SEC_E_INVALID_TOKEN;
+
+  auth_state state = as_ok;
+  memcpy ( &state, buf->ByteStream ( ), sizeof(state) );
+  if ( state != as_ok )
+  {
+    Free ( );
+    m_state = as_denied;
+    return SEC_E_LOGON_DENIED;
+  }
+  return SEC_E_OK;
 }
 
 
 //======================================================================
 // ServerContext implementation
 
+/**
+  We're the server side
+*/
+bool ServerContext::IsServer ( ) const
+{
+  return true;
+}
 
 SECURITY_STATUS 
 ServerContext::CreateContext ( 
@@ -633,18 +1395,19 @@ ServerContext::CreateContext (
 {
   assert ( ibd != 0 );
 
-  DWORD     ctxt_attr;
-  TimeStamp expiration;
+  ULONG reqs = m_ctxt_reqs & ~ASC_REQ_ALLOCATE_MEMORY;
+  if ( m_token_alloc == ta_provider )
+    reqs |= ASC_REQ_ALLOCATE_MEMORY;
 
   SECURITY_STATUS status = 0;
   status = g_sspi->AcceptSecurityContext (
                 m_cred->GetHandle ( ),
                 old_ctxt,
                 ibd,
-                m_ctxt_reqs & ~ASC_REQ_ALLOCATE_MEMORY,
+                reqs,
                 m_data_rep, new_ctxt,
                 obd,
-                &ctxt_attr, &expiration
+                &m_ctxt_attr, &m_expiry
               );
   return status;
 }
@@ -657,6 +1420,10 @@ ServerContext::CreateContext (
 
   The returned buffer is allocated by the function, and
   freed automatically on the buffer's destruction.
+
+  In cm_optimistic mode, a successful authentication
+  needs no confirmation, so buf is left empty (not
+  IsValid()) and there's nothing to send.
 */
 void ServerContext::ConfirmAuthentication ( Buffer & buf )
 {
@@ -664,6 +1431,8 @@ void ServerContext::ConfirmAuthentication ( Buffer & buf )
   // message to the client that confirms the
   // login
   buf.Free ( );
+  if ( m_confirm_mode == cm_optimistic && m_state == as_ok )
+    return;
   buf.Allocate ( sizeof(auth_state), bt_confirmation );
   buf.SetContents ( (BYTE*)&m_state, sizeof(m_state) );
 } 
@@ -674,11 +1443,7 @@ void ServerContext::ConfirmAuthentication ( Buffer & buf )
 */
 void ServerContext::ImpersonateClient ( )
 {
-  assert ( IsValid ( ) );
-  assert ( m_state == as_ok );
-  SECURITY_STATUS status = 0;
-  status = g_sspi->ImpersonateSecurityContext ( GetHandle ( ) );
-
+  SECURITY_STATUS status = TryImpersonateClient ( );
   if ( status != SEC_E_OK )
     throwexe ( err_impersonate, status );
 }
@@ -688,19 +1453,55 @@ void ServerContext::ImpersonateClient ( )
   returns to it's original security context.
 */
 void ServerContext::RevertToSelf ( )
+{
+  SECURITY_STATUS status = TryRevertToSelf ( );
+  if ( status != SEC_E_OK )
+    throwexe ( err_revert_to_self, status );
+}
+
+/**
+  Like ImpersonateClient(), but returns the
+  status instead of throwing.
+*/
+SECURITY_STATUS ServerContext::TryImpersonateClient ( ) throw()
+{
+  assert ( IsValid ( ) );
+  assert ( m_state == as_ok );
+  SECURITY_STATUS status = 0;
+  status = g_sspi->ImpersonateSecurityContext ( GetHandle ( ) );
+
+  if ( status == SEC_E_OK )
+    ImpersonationScope::SetCurrent ( this );
+  return status;
+}
+
+/**
+  Like RevertToSelf(), but returns the
+  status instead of throwing.
+*/
+SECURITY_STATUS ServerContext::TryRevertToSelf ( ) throw()
 {
   assert ( IsValid ( ) );
   assert ( m_state == as_ok );
   SECURITY_STATUS status = 0;
   status = g_sspi->RevertSecurityContext ( GetHandle ( ) );
 
-  if ( status != SEC_E_OK )
-    throwexe ( err_revert_to_self, status );
+  if ( status == SEC_E_OK )
+    ImpersonationScope::SetCurrent ( 0 );
+  return status;
 }
 
 
 //======================================================================
-// ServerContext implementation
+// ClientContext implementation
+
+/**
+  We're the client side
+*/
+bool ClientContext::IsServer ( ) const
+{
+  return false;
+}
 
 SECURITY_STATUS 
 ClientContext::CreateContext ( 
@@ -708,27 +1509,58 @@ ClientContext::CreateContext (
             PCtxtHandle new_ctxt, PSecBufferDesc obd
           )
 {
-  DWORD     ctxt_attr;
-  TimeStamp expiration;
-
-  // check the input buffer and see if it's a confirmation
+  // check the input buffer and see if it's a confirmation.
+  // the type comes from the server, so don't trust the size
   if ( ibd != 0 && ibd->pBuffers[0].BufferType == bt_confirmation )
   {
-    m_state = *((auth_state*)ibd->pBuffers[0].pvBuffer);
-    if ( m_state != as_ok ) return SEC_E_LOGON_DENIED;
-    else return SEC_E_OK;
+    // there's nothing to send back
+    obd->pBuffers[0].cbBuffer = 0;
+    const SecBuffer & conf = ibd->pBuffers[0];
+    if ( conf.cbBuffer < sizeof(auth_state) || conf.pvBuffer == 0 )
+      return SEC_E_INVALID_TOKEN;
+    auth_state state = as_ok;
+    memcpy ( &state, conf.pvBuffer, sizeof(state) );
+    if ( state != as_ok ) return SEC_E_LOGON_DENIED;
+    m_state = as_ok;
+    return SEC_E_OK;
+  }
+  // or a final token with the confirmation appended
+  if ( ibd != 0 && ibd->pBuffers[0].BufferType == bt_token_confirmation )
+  {
+    SecBuffer & tok = ibd->pBuffers[0];
+    if ( tok.cbBuffer < sizeof(auth_state) || tok.pvBuffer == 0 )
+    {
+      obd->pBuffers[0].cbBuffer = 0;
+      return SEC_E_INVALID_TOKEN;
+    }
+    tok.cbBuffer  -= sizeof(auth_state);
+    tok.BufferType = bt_token;
+    auth_state state = as_ok;
+    memcpy ( &state, (BYTE*)tok.pvBuffer + tok.cbBuffer, sizeof(state) );
+    if ( state != as_ok )
+    {
+      obd->pBuffers[0].cbBuffer = 0;
+      return SEC_E_LOGON_DENIED;
+    }
   }
 
+  ULONG reqs = m_ctxt_reqs & ~ISC_REQ_ALLOCATE_MEMORY;
+  if ( m_token_alloc == ta_provider )
+    reqs |= ISC_REQ_ALLOCATE_MEMORY;
+
   SECURITY_STATUS status = 0;
   status = g_sspi->InitializeSecurityContext (
                 m_cred->GetHandle ( ),
                 old_ctxt,
                 const_cast<TCHAR*>(m_cred->Target()),
-                m_ctxt_reqs & ~ISC_REQ_ALLOCATE_MEMORY,
+                reqs,
                 0, m_data_rep,
                 ibd, 0, new_ctxt, obd,
-                &ctxt_attr, &expiration
+                &m_ctxt_attr, &m_expiry
               );
+  if ( m_confirm_mode == cm_optimistic )
+    return status;
+
   // whatever the return, wait for the server to 
   // confirm authentication
   if ( status == SEC_E_OK )
@@ -0,0 +1,609 @@
+//==============================================================================
+// File: 			    sspidrv.cpp
+//
+// Description: 	implementation of our asynchronous handshake driver
+//
+//==============================================================================
+// Copyright(C) 2000, Tomas Restrepo. All rights reserved
+// Send comments to: tomasr@mvps.org
+//==============================================================================
+
+#include "stdafx.h"
+
+// needs exceptions, see sspiex.h
+#ifndef WSSPI_NO_EXCEPTIONS
+
+// only linked in by programs that use this code
+#pragma comment(lib, "ws2_32.lib")
+
+using namespace WSSPI2;
+
+namespace {
+  // completion key used by Stop()
+  const ULONG_PTR STOP_KEY = 1;
+  // completion key for our sockets
+  const ULONG_PTR CONN_KEY = 0;
+  // size of our frame header
+  const DWORD HEADER_SIZE = 8;
+}
+
+HandshakeDriver::HandshakeDriver ( 
+      HandshakeHandler & handler, 
+      DWORD leg_timeout /*= 30000*/ 
+    )
+  : m_handler ( handler ),
+    m_leg_timeout ( leg_timeout ),
+    m_port ( 0 ),
+    m_exec ( 0 )
+{
+  m_port = CreateIoCompletionPort ( INVALID_HANDLE_VALUE, NULL, 0, 1 );
+  if ( m_port == NULL )
+    throwexe ( err_io_failed, HRESULT_FROM_WIN32(GetLastError ( )) );
+}
+
+/**
+  Destroys the driver. Handshakes still in progress 
+  are aborted, and reported to the handler with 
+  ERROR_OPERATION_ABORTED.
+*/
+HandshakeDriver::~HandshakeDriver ( )
+{
+  std::set<conn*>::iterator it;
+  for ( it = m_conns.begin ( ); it != m_conns.end ( ); ++it )
+    CancelIo ( (HANDLE)(*it)->s );
+
+  // wait for the aborted operations, since 
+  // their OVERLAPPED structs are still in use
+  while ( !m_conns.empty ( ) )
+  {
+    DWORD bytes = 0;
+    ULONG_PTR key = 0;
+    LPOVERLAPPED ov = 0;
+    GetQueuedCompletionStatus ( m_port, &bytes, &key, &ov, INFINITE );
+    if ( ov != 0 )
+      Finish ( (conn*)ov, as_error, ERROR_OPERATION_ABORTED );
+  }
+  CloseHandle ( m_port );
+}
+
+/**
+  Sets where provider calls run. NULL (the default)
+  runs them inline on the loop thread. The executor
+  must outlive the driver.
+*/
+void HandshakeDriver::SetExecutor ( Executor * exec )
+{
+  m_exec = exec;
+}
+
+/**
+  Starts a handshake on socket s with ctxt, which must 
+  already have its credentials set. The driver owns both 
+  until it calls HandshakeHandler::OnHandshakeDone().
+  The socket is associated with the driver's completion
+  port the first time it's added; adding it again (say,
+  to renegotiate) reuses that association.
+*/
+void HandshakeDriver::Add ( SOCKET s, Context * ctxt )
+{
+  assert ( ctxt != 0 );
+  assert ( s != INVALID_SOCKET );
+
+  // a handle can only be associated once, so
+  // remember the ones we did
+  if ( m_sockets.find ( s ) == m_sockets.end ( ) )
+  {
+    m_sockets.insert ( s );
+    if ( CreateIoCompletionPort ( (HANDLE)s, m_port, CONN_KEY, 0 ) == NULL )
+    {
+      DWORD error = GetLastError ( );
+      m_sockets.erase ( s );
+      throwexe ( err_io_failed, HRESULT_FROM_WIN32(error) );
+    }
+  }
+
+  conn * c = NewConn ( s, ctxt );
+
+  // clients talk first
+  if ( ctxt->IsServer ( ) )
+    StartRead ( c );
+  else
+    Step ( c );
+}
+
+/**
+  Forgets that s was associated with our port. Call it
+  once you're done with a socket you added, before you
+  close it. Don't call it while s is still in use.
+*/
+void HandshakeDriver::Forget ( SOCKET s )
+{
+  m_sockets.erase ( s );
+}
+
+/**
+  Runs the loop for up to timeout milliseconds 
+  (INFINITE is fine), processing I/O and timeouts.
+  Returns false if Stop() was called.
+*/
+bool HandshakeDriver::Run ( DWORD timeout )
+{
+  DWORD start = GetTickCount ( );
+  for ( ;; )
+  {
+    ExpireTimers ( );
+
+    DWORD wait = INFINITE;
+    if ( timeout != INFINITE )
+    {
+      DWORD elapsed = GetTickCount ( ) - start;
+      wait = (elapsed < timeout) ? (timeout - elapsed) : 0;
+    }
+    DWORD next = NextTimer ( );
+    if ( next < wait )
+      wait = next;
+
+    DWORD bytes = 0;
+    ULONG_PTR key = 0;
+    LPOVERLAPPED ov = 0;
+    BOOL ok = GetQueuedCompletionStatus ( m_port, &bytes, &key, &ov, wait );
+    if ( ov != 0 )
+    {
+      OnCompletion ( (conn*)ov, ok ? 0 : GetLastError ( ), bytes );
+    }
+    else if ( ok && key == STOP_KEY )
+    {
+      return false;
+    }
+    else if ( timeout != INFINITE && (GetTickCount ( ) - start) >= timeout )
+    {
+      ExpireTimers ( );
+      return true;
+    }
+  }
+}
+
+/**
+  Encrypts data with the established context ctxt and
+  sends it over s, as a single bt_data frame holding
+  the record laid out by MessageFrame. data is copied
+  once, into the frame that then gets encrypted in place
+  and sent from where it is, so it can go away as soon
+  as Send() returns. size can't be 0. The
+  driver owns the socket and the context until it calls
+  HandshakeHandler::OnSendDone(); don't start another
+  operation on them before that.
+
+  s must have gone through Add() already, or be
+  associated with the driver's port some other way.
+*/
+void HandshakeDriver::Send ( 
+      SOCKET s, Context * ctxt, 
+      const void * data, DWORD size 
+    )
+{
+  assert ( ctxt != 0 );
+  assert ( ctxt->IsValid ( ) );
+  if ( data == 0 || size == 0 )
+    throwexe ( err_encrypt_failed, HRESULT_FROM_WIN32(ERROR_INVALID_PARAMETER) );
+
+  conn * c = NewConn ( s, ctxt );
+  c->sending = true;
+  c->frame.Prepare ( *ctxt, size );
+  memcpy ( c->frame.Data ( ), data, size );
+  Step ( c );
+}
+
+/**
+  Makes Run() return false as soon as possible.
+  Can be called from any thread.
+*/
+void HandshakeDriver::Stop ( )
+{
+  PostQueuedCompletionStatus ( m_port, 0, STOP_KEY, NULL );
+}
+
+/**
+  Returns the number of handshakes in progress
+*/
+size_t HandshakeDriver::Pending ( ) const
+{
+  return m_conns.size ( );
+}
+
+/**
+  Creates and registers the state for an operation
+*/
+HandshakeDriver::conn * HandshakeDriver::NewConn ( SOCKET s, Context * ctxt )
+{
+  conn * c = new conn;
+  if ( c == 0 ) throwex ( err_no_memory );
+  memset ( &c->ov, 0, sizeof(c->ov) );
+  c->s         = s;
+  c->ctxt      = ctxt;
+  c->phase     = cp_read_header;
+  c->done      = 0;
+  c->finished  = false;
+  c->timed_out = false;
+  c->sending   = false;
+  c->wire      = 0;
+  c->wire_size = 0;
+  c->state     = as_continue;
+  c->error     = 0;
+  c->task.drv  = this;
+  c->task.c    = c;
+  c->timer     = m_timers.end ( );
+  m_conns.insert ( c );
+  ResetTimer ( c );
+  return c;
+}
+
+/**
+  Runs the next provider call for c, either right
+  here or on the executor
+*/
+void HandshakeDriver::Step ( conn * c )
+{
+  c->phase = cp_leg;
+  if ( m_exec == 0 )
+  {
+    RunLeg ( c );
+    AfterLeg ( c );
+    return;
+  }
+  memset ( &c->ov, 0, sizeof(c->ov) );
+  DWORD error = 0;
+  try {
+    m_exec->Post ( &c->task );
+    return;
+#ifndef WSSPI_EX_THROW_NEW
+  } catch ( SspiEx & e ) {
+    error = e.Win32Err ( );
+  }
+#else
+  } catch ( SspiEx * e ) {
+    error = e->Win32Err ( );
+    e->Free ( );
+  }
+#endif
+  catch ( ... ) {
+    // std::bad_alloc
+  }
+  // the task never got queued, so the
+  // connection ends here
+  Finish ( c, as_error, (error != 0) ? error : ERROR_NOT_ENOUGH_MEMORY );
+}
+
+/**
+  Runs on the executor; the result goes back to
+  the loop thread through the completion port.
+*/
+void HandshakeDriver::leg_task::Run ( )
+{
+  drv->RunLeg ( c );
+  PostQueuedCompletionStatus ( drv->m_port, 0, CONN_KEY, &c->ov );
+}
+
+/**
+  Sends are data plane work, legs aren't
+*/
+bool HandshakeDriver::leg_task::DataPlane ( ) const
+{
+  return c->sending;
+}
+
+/**
+  Runs an authentication leg with whatever we 
+  received (or encrypts the message to send), and 
+  frames the reply. Touches nothing but c, since it
+  may run on another thread, and never throws: 
+  failures end up in c->error.
+*/
+void HandshakeDriver::RunLeg ( conn * c )
+{
+  c->out.clear ( );
+  c->wire      = 0;
+  c->wire_size = 0;
+  c->error     = 0;
+  try {
+    if ( c->sending )
+    {
+      // the record goes out straight from the frame
+      c->ctxt->EncryptMessage ( 0, c->frame );
+      QueueHeader ( c, bt_data, c->frame.WireSize ( ) );
+      c->wire      = c->frame.WireData ( );
+      c->wire_size = c->frame.WireSize ( );
+      c->state = as_ok;
+    }
+    else
+    {
+      Buffer out, conf;
+      c->state = c->ctxt->Authenticate ( c->in.IsValid ( ) ? &c->in : NULL, &out );
+      if ( c->state != as_continue && c->ctxt->IsServer ( ) )
+        static_cast<ServerContext*>(c->ctxt)->ConfirmAuthentication ( conf );
+      if ( out.IsValid ( ) )
+        Queue ( c, out.Type ( ), out.ByteStream ( ), out.Size ( ) );
+      if ( conf.IsValid ( ) )
+        Queue ( c, conf.Type ( ), conf.ByteStream ( ), conf.Size ( ) );
+    }
+#ifndef WSSPI_EX_THROW_NEW
+  } catch ( SspiEx & e ) {
+    c->error = e.Win32Err ( );
+  }
+#else
+  } catch ( SspiEx * e ) {
+    c->error = e->Win32Err ( );
+    e->Free ( );
+  }
+#endif
+  catch ( ... ) {
+    // std::bad_alloc
+    c->error = ERROR_NOT_ENOUGH_MEMORY;
+  }
+  c->in.Free ( );
+  c->finished = c->sending || (c->state != as_continue);
+}
+
+/**
+  Sends the reply of a leg, or waits for the next token
+*/
+void HandshakeDriver::AfterLeg ( conn * c )
+{
+  if ( c->error != 0 )
+  {
+    Finish ( c, as_error, c->error );
+    return;
+  }
+  ResetTimer ( c );
+
+  if ( !c->out.empty ( ) )
+    StartWrite ( c );
+  else if ( c->finished )
+    Finish ( c, c->state, 0 );
+  else
+    StartRead ( c );
+}
+
+/**
+  An I/O operation on c completed
+*/
+void HandshakeDriver::OnCompletion ( conn * c, DWORD error, DWORD bytes )
+{
+  if ( c->timed_out )
+  {
+    Finish ( c, as_error, ERROR_TIMEOUT );
+    return;
+  }
+  if ( error != 0 )
+  {
+    Finish ( c, as_error, error );
+    return;
+  }
+  if ( bytes == 0 && (c->phase == cp_read_header || c->phase == cp_read_body) )
+  {
+    // the peer went away
+    Finish ( c, as_error, ERROR_GRACEFUL_DISCONNECT );
+    return;
+  }
+
+  c->done += bytes;
+  switch ( c->phase )
+  {
+  case cp_leg:
+    AfterLeg ( c );
+    break;
+  case cp_read_header:
+    if ( c->done == HEADER_SIZE )
+    {
+      ULONG type = 0, size = 0;
+      memcpy ( &type, c->header, 4 );
+      memcpy ( &size, c->header + 4, 4 );
+      size = ntohl ( size );
+      if ( size == 0 || size > max_frame )
+      {
+        Finish ( c, as_error, ERROR_INVALID_DATA );
+        return;
+      }
+      c->in.Allocate ( size, (buffer_type)ntohl ( type ) );
+      c->phase = cp_read_body;
+      c->done  = 0;
+    }
+    StartRead ( c );
+    break;
+  case cp_read_body:
+    if ( c->done == c->in.Size ( ) )
+      Step ( c );
+    else
+      StartRead ( c );
+    break;
+  case cp_write:
+    if ( c->done < WriteSize ( c ) )
+      StartWrite ( c );
+    else if ( c->finished )
+      Finish ( c, c->state, 0 );
+    else
+    {
+      c->phase = cp_read_header;
+      c->done  = 0;
+      StartRead ( c );
+    }
+    break;
+  }
+}
+
+/**
+  Issues a receive for the rest of the current
+  header or token
+*/
+void HandshakeDriver::StartRead ( conn * c )
+{
+  WSABUF wb;
+  if ( c->phase == cp_write )
+  {
+    c->phase = cp_read_header;
+    c->done  = 0;
+  }
+  if ( c->phase == cp_read_header )
+  {
+    wb.buf = (CHAR*)c->header + c->done;
+    wb.len = HEADER_SIZE - c->done;
+  }
+  else
+  {
+    wb.buf = (CHAR*)c->in.GetBufferForRecv ( ) + c->done;
+    wb.len = c->in.Size ( ) - c->done;
+  }
+
+  DWORD flags = 0;
+  memset ( &c->ov, 0, sizeof(c->ov) );
+  if ( WSARecv ( c->s, &wb, 1, NULL, &flags, &c->ov, NULL ) == SOCKET_ERROR )
+  {
+    int error = WSAGetLastError ( );
+    if ( error != WSA_IO_PENDING )
+      Finish ( c, as_error, error );
+  }
+}
+
+/**
+  Issues a send for the rest of the queued frames,
+  followed by the sealed record, if any
+*/
+void HandshakeDriver::StartWrite ( conn * c )
+{
+  if ( c->phase != cp_write )
+  {
+    c->phase = cp_write;
+    c->done  = 0;
+  }
+  WSABUF wb[2];
+  DWORD count = 0;
+  DWORD done  = c->done;
+  DWORD head  = c->out.size ( );
+  if ( done < head )
+  {
+    wb[count].buf = (CHAR*)&c->out[0] + done;
+    wb[count].len = head - done;
+    count++;
+    done = 0;
+  }
+  else
+  {
+    done -= head;
+  }
+  if ( done < c->wire_size )
+  {
+    wb[count].buf = (CHAR*)c->wire + done;
+    wb[count].len = c->wire_size - done;
+    count++;
+  }
+
+  memset ( &c->ov, 0, sizeof(c->ov) );
+  if ( WSASend ( c->s, wb, count, NULL, 0, &c->ov, NULL ) == SOCKET_ERROR )
+  {
+    int error = WSAGetLastError ( );
+    if ( error != WSA_IO_PENDING )
+      Finish ( c, as_error, error );
+  }
+}
+
+/**
+  Appends a frame to the data to send
+*/
+void HandshakeDriver::Queue ( 
+      conn * c, buffer_type type, 
+      const BYTE * data, DWORD size 
+    )
+{
+  QueueHeader ( c, type, size );
+  c->out.insert ( c->out.end ( ), data, data + size );
+}
+
+/**
+  Appends just the header of a frame; the 
+  body has to follow some other way
+*/
+void HandshakeDriver::QueueHeader ( conn * c, buffer_type type, DWORD size )
+{
+  ULONG ntype = htonl ( (ULONG)type );
+  ULONG nsize = htonl ( size );
+  const BYTE * t = (const BYTE*)&ntype;
+  const BYTE * s = (const BYTE*)&nsize;
+  c->out.insert ( c->out.end ( ), t, t + 4 );
+  c->out.insert ( c->out.end ( ), s, s + 4 );
+}
+
+/**
+  Returns the bytes StartWrite() has to send in all
+*/
+DWORD HandshakeDriver::WriteSize ( const conn * c )
+{
+  return c->out.size ( ) + c->wire_size;
+}
+
+/**
+  Ends a handshake and hands it back to its owner
+*/
+void HandshakeDriver::Finish ( conn * c, auth_state state, DWORD error )
+{
+  if ( c->timer != m_timers.end ( ) )
+    m_timers.erase ( c->timer );
+  m_conns.erase ( c );
+  // a failed send doesn't spoil an established context
+  if ( state == as_error && !c->sending )
+    c->ctxt->Free ( );
+
+  SOCKET s = c->s;
+  Context * ctxt = c->ctxt;
+  bool sending = c->sending;
+  delete c;
+  if ( sending )
+    m_handler.OnSendDone ( s, ctxt, error );
+  else
+    m_handler.OnHandshakeDone ( s, ctxt, state, error );
+}
+
+/**
+  Starts the clock for a new leg
+*/
+void HandshakeDriver::ResetTimer ( conn * c )
+{
+  if ( c->timer != m_timers.end ( ) )
+    m_timers.erase ( c->timer );
+  c->started = GetTickCount ( );
+  c->timer = m_timers.insert ( m_timers.end ( ), c );
+}
+
+/**
+  Aborts the I/O of connections whose current leg took 
+  too long. Since all legs have the same timeout, 
+  m_timers is sorted, and we only look at expired entries.
+*/
+void HandshakeDriver::ExpireTimers ( )
+{
+  DWORD now = GetTickCount ( );
+  while ( !m_timers.empty ( ) )
+  {
+    conn * c = m_timers.front ( );
+    if ( (now - c->started) < m_leg_timeout )
+      break;
+    m_timers.pop_front ( );
+    c->timer = m_timers.end ( );
+    c->timed_out = true;
+    // the aborted operation completes with an 
+    // error, and OnCompletion() finishes it off
+    CancelIo ( (HANDLE)c->s );
+  }
+}
+
+/**
+  Returns the time until the next leg timeout
+*/
+DWORD HandshakeDriver::NextTimer ( ) const
+{
+  if ( m_timers.empty ( ) )
+    return INFINITE;
+  DWORD elapsed = GetTickCount ( ) - m_timers.front ( )->started;
+  return (elapsed < m_leg_timeout) ? (m_leg_timeout - elapsed) : 0;
+}
+
+#endif // WSSPI_NO_EXCEPTIONS
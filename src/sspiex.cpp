@@ -75,6 +75,7 @@ wsstring SspiEx::ErrorString ( ) const
     { err_export_failed,      _T("failed to export security context") },
     { err_act_failed,         _T("ApplyControlToken() failed") },
     { err_query_token_failed, _T("QuerySecurityContextToken() failed")},
+    { err_io_failed,          _T("socket or completion port failure") },
     { err_unknown,            _T("unknown error") }
   };
   assert (m_err <= err_unknown );
@@ -104,6 +105,38 @@ wsstring SspiEx::Win32ErrString ( ) const
   return str;
 }
 
+//! called by Fail() before giving up
+static SspiEx::fail_handler g_fail_handler = 0;
+
+/**
+  Installs the function Fail() calls before aborting,
+  so the application can log the error (or longjmp out, 
+  if it knows what it is doing). Returns the previous 
+  handler.
+*/
+SspiEx::fail_handler SspiEx::SetFailHandler ( fail_handler handler )
+{
+  return (fail_handler)InterlockedExchangePointer ( 
+                (PVOID volatile*)&g_fail_handler, (PVOID)handler 
+              );
+}
+
+/**
+  Where throwex() ends up in WSSPI_NO_EXCEPTIONS builds.
+  The failure can't be reported to the caller, so after
+  the fail handler (if any) runs, the process is ended.
+  The Try* methods return a status for anything that 
+  can reasonably fail; only running out of memory 
+  or misuse gets here through them.
+*/
+void SspiEx::Fail ( const SspiEx & e )
+{
+  fail_handler handler = g_fail_handler;
+  if ( handler != 0 )
+    handler ( e );
+  abort ( );
+}
+
 /**
   Dumps this exception object
 */
@@ -0,0 +1,44 @@
+//==============================================================================
+// File: 			    sspiexec.cpp
+//
+// Description: 	implementation of the executors used to run provider calls
+//
+//==============================================================================
+// Copyright(C) 2000, Tomas Restrepo. All rights reserved
+// Send comments to: tomasr@mvps.org
+//==============================================================================
+
+#include "stdafx.h"
+
+using namespace WSSPI2;
+
+
+void InlineExecutor::Post ( Task * task )
+{
+  assert ( task != 0 );
+  task->Run ( );
+}
+
+
+/**
+  Set long_running if tasks may block for a
+  while (say, a Kerberos KDC round trip), so
+  the pool grows threads for them.
+*/
+PoolExecutor::PoolExecutor ( bool long_running /*= false*/ )
+  : m_flags ( long_running ? WT_EXECUTELONGFUNCTION : WT_EXECUTEDEFAULT )
+{
+}
+
+void PoolExecutor::Post ( Task * task )
+{
+  assert ( task != 0 );
+  if ( !QueueUserWorkItem ( Thunk, task, m_flags ) )
+    throwexe ( err_io_failed, HRESULT_FROM_WIN32(GetLastError ( )) );
+}
+
+DWORD WINAPI PoolExecutor::Thunk ( LPVOID param )
+{
+  static_cast<Task*>(param)->Run ( );
+  return 0;
+}
@@ -0,0 +1,222 @@
+//==============================================================================
+// File: 			    sspihand.cpp
+//
+// Description: 	implementation of our context handoff between processes
+//
+//==============================================================================
+// Copyright(C) 2000, Tomas Restrepo. All rights reserved
+// Send comments to: tomasr@mvps.org
+//==============================================================================
+
+#include "stdafx.h"
+
+// needs exceptions, see sspiex.h
+#ifndef WSSPI_NO_EXCEPTIONS
+
+// only linked in by programs that use this code
+#pragma comment(lib, "ws2_32.lib")
+
+using namespace WSSPI2;
+
+namespace {
+  const DWORD HANDOFF_MAGIC   = 0x48535357; // "WSSH"
+  const DWORD HANDOFF_VERSION = 2;
+}
+
+
+/**
+  Hands s and ctxt over to the worker process 
+  worker_pid, which must call Receive() on the other
+  end of pipe. On success, s is closed and ctxt freed.
+*/
+void ContextHandoff::Send ( 
+      HANDLE pipe, 
+      DWORD worker_pid, 
+      SOCKET s, 
+      Context & ctxt 
+    )
+{
+  WSAPROTOCOL_INFO info;
+  if ( WSADuplicateSocket ( s, worker_pid, &info ) == SOCKET_ERROR )
+    throwexe ( err_io_failed, HRESULT_FROM_WIN32(WSAGetLastError ( )) );
+
+  HANDLE process = OpenProcess ( PROCESS_DUP_HANDLE, FALSE, worker_pid );
+  if ( process == NULL )
+    throwexe ( err_io_failed, HRESULT_FROM_WIN32(GetLastError ( )) );
+
+  Buffer blob;
+  HANDLE token = NULL;
+  DWORD error = 0;
+  bool sent = false;
+  try {
+    token = ShareToken ( process, ctxt, blob );
+
+    header h;
+    h.magic     = HANDOFF_MAGIC;
+    h.version   = HANDOFF_VERSION;
+    h.blob_size = blob.Size ( );
+    h.token     = (DWORD)(ULONG_PTR)token;
+    Write ( pipe, &h, sizeof(h) );
+    // from here on, the worker closes the token
+    sent = true;
+    Write ( pipe, &info, sizeof(info) );
+    Write ( pipe, blob.ByteStream ( ), blob.Size ( ) );
+    Read ( pipe, &error, sizeof(error) );
+  } catch ( ... ) {
+    if ( token != NULL && !sent )
+      DuplicateHandle ( process, token, NULL, NULL, 0, FALSE, DUPLICATE_CLOSE_SOURCE );
+    CloseHandle ( process );
+    throw;
+  }
+  CloseHandle ( process );
+  if ( error != 0 )
+    throwexe ( err_import_failed, error );
+
+  // the worker has its own copies now
+  ctxt.Free ( );
+  closesocket ( s );
+}
+
+/**
+  Takes over a connection handed off by Send(), 
+  importing its context into ctxt (which must have
+  its credentials set). Returns the socket.
+*/
+SOCKET ContextHandoff::Receive ( HANDLE pipe, Context & ctxt )
+{
+  header h;
+  Read ( pipe, &h, sizeof(h) );
+  if ( h.magic != HANDOFF_MAGIC || h.version != HANDOFF_VERSION )
+  {
+    Acknowledge ( pipe, SEC_E_INVALID_TOKEN );
+    throwexe ( err_import_failed, SEC_E_INVALID_TOKEN );
+  }
+  // the acceptor put it in our handle table,
+  // and it's ours to close whatever happens
+  HANDLE token = (HANDLE)(ULONG_PTR)h.token;
+  if ( h.blob_size == 0 || h.blob_size > max_blob )
+  {
+    if ( token != NULL )
+      CloseHandle ( token );
+    Acknowledge ( pipe, SEC_E_INVALID_TOKEN );
+    throwexe ( err_import_failed, SEC_E_INVALID_TOKEN );
+  }
+
+  WSAPROTOCOL_INFO info;
+  Buffer blob;
+  try {
+    Read ( pipe, &info, sizeof(info) );
+    blob.Allocate ( h.blob_size, bt_token );
+    Read ( pipe, blob.GetBufferForRecv ( ), h.blob_size );
+  } catch ( ... ) {
+    if ( token != NULL )
+      CloseHandle ( token );
+    throw;
+  }
+
+  SOCKET s = WSASocket ( 
+                FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO,
+                &info, 0, WSA_FLAG_OVERLAPPED 
+              );
+  if ( s == INVALID_SOCKET )
+  {
+    DWORD error = HRESULT_FROM_WIN32(WSAGetLastError ( ));
+    if ( token != NULL )
+      CloseHandle ( token );
+    Acknowledge ( pipe, error );
+    throwexe ( err_io_failed, error );
+  }
+
+  try {
+    ctxt.Import ( blob, token );
+#ifndef WSSPI_EX_THROW_NEW
+  } catch ( SspiEx & e ) {
+    if ( token != NULL )
+      CloseHandle ( token );
+    closesocket ( s );
+    Acknowledge ( pipe, e.Win32Err ( ) );
+    throw;
+  }
+#else
+  } catch ( SspiEx * e ) {
+    if ( token != NULL )
+      CloseHandle ( token );
+    closesocket ( s );
+    Acknowledge ( pipe, e->Win32Err ( ) );
+    throw;
+  }
+#endif
+  if ( token != NULL )
+    CloseHandle ( token );
+  Acknowledge ( pipe, 0 );
+  return s;
+}
+
+void ContextHandoff::Write ( HANDLE pipe, const void * data, DWORD size )
+{
+  const BYTE * p = (const BYTE*)data;
+  while ( size > 0 )
+  {
+    DWORD written = 0;
+    if ( !WriteFile ( pipe, p, size, &written, NULL ) )
+      throwexe ( err_io_failed, HRESULT_FROM_WIN32(GetLastError ( )) );
+    p    += written;
+    size -= written;
+  }
+}
+
+void ContextHandoff::Read ( HANDLE pipe, void * data, DWORD size )
+{
+  BYTE * p = (BYTE*)data;
+  while ( size > 0 )
+  {
+    DWORD read = 0;
+    if ( !ReadFile ( pipe, p, size, &read, NULL ) )
+      throwexe ( err_io_failed, HRESULT_FROM_WIN32(GetLastError ( )) );
+    if ( read == 0 )
+      throwexe ( err_io_failed, HRESULT_FROM_WIN32(ERROR_GRACEFUL_DISCONNECT) );
+    p    += read;
+    size -= read;
+  }
+}
+
+/**
+  Exports ctxt into blob and, for server contexts,
+  duplicates its token into process. Returns the
+  token's handle in process, or NULL.
+*/
+HANDLE ContextHandoff::ShareToken ( HANDLE process, Context & ctxt, Buffer & blob )
+{
+  if ( !ctxt.IsServer ( ) )
+  {
+    ctxt.Export ( blob );
+    return NULL;
+  }
+
+  HANDLE token = NULL;
+  ctxt.Export ( blob, &token );
+  if ( token == NULL )
+    return NULL;
+  HANDLE remote = NULL;
+  BOOL ok = DuplicateHandle ( 
+                GetCurrentProcess ( ), token, process, &remote, 
+                0, FALSE, DUPLICATE_SAME_ACCESS 
+              );
+  DWORD error = GetLastError ( );
+  CloseHandle ( token );
+  if ( !ok )
+    throwexe ( err_export_failed, HRESULT_FROM_WIN32(error) );
+  return remote;
+}
+
+/**
+  Tells the acceptor how the handoff went. If we
+  can't even do that, it'll see the pipe break.
+*/
+void ContextHandoff::Acknowledge ( HANDLE pipe, DWORD error )
+{
+  DWORD written = 0;
+  WriteFile ( pipe, &error, sizeof(error), &written, NULL );
+}
+
+#endif // WSSPI_NO_EXCEPTIONS
@@ -0,0 +1,160 @@
+//==============================================================================
+// File: 			    sspiimp.cpp
+//
+// Description: 	implementation of our scoped impersonation guard
+//
+//==============================================================================
+// Copyright(C) 2000, Tomas Restrepo. All rights reserved
+// Send comments to: tomasr@mvps.org
+//==============================================================================
+
+#include "stdafx.h"
+
+using namespace WSSPI2;
+
+// static objects
+volatile LONG ImpersonationScope::m_tls_ctxt = (LONG)TLS_OUT_OF_INDEXES;
+volatile LONG ImpersonationScope::m_tls_serial = (LONG)TLS_OUT_OF_INDEXES;
+long ImpersonationScope::m_switches = 0;
+long ImpersonationScope::m_avoided = 0;
+
+
+/**
+  Impersonates the client of ctxt, unless the
+  thread already is
+*/
+ImpersonationScope::ImpersonationScope ( 
+      ServerContext & ctxt, 
+      bool lazy /*= false*/ 
+    )
+  : m_ctxt ( &ctxt ),
+    m_previous ( Current ( ) ),
+    m_lazy ( lazy ),
+    m_switched ( false )
+{
+  if ( IsCurrent ( m_ctxt ) )
+  {
+    InterlockedIncrement ( &m_avoided );
+    return;
+  }
+  // same address, different serial: the context we
+  // found was freed, so there's nothing to go back to
+  if ( m_previous == m_ctxt )
+    m_previous = 0;
+  m_ctxt->ImpersonateClient ( );
+  m_switched = true;
+}
+
+/**
+  Puts back the impersonation we found, if it
+  was a different one. A lazy scope that found
+  none leaves its own in place.
+*/
+ImpersonationScope::~ImpersonationScope ( )
+{
+  if ( !m_switched || (m_lazy && m_previous == 0) )
+  {
+    InterlockedIncrement ( &m_avoided );
+    return;
+  }
+  // destructors mustn't throw; if we can't put 
+  // things back, make sure we aren't anybody
+  SECURITY_STATUS status = (m_previous != 0) 
+                         ? m_previous->TryImpersonateClient ( )
+                         : m_ctxt->TryRevertToSelf ( );
+  if ( status != SEC_E_OK )
+  {
+    ::RevertToSelf ( );
+    SetCurrent ( 0 );
+  }
+}
+
+/**
+  Ends whatever impersonation a lazy scope left
+  behind on the calling thread
+*/
+void ImpersonationScope::RevertThread ( )
+{
+  // the context may be gone by now, so
+  // don't go through it
+  if ( Current ( ) == 0 )
+    return;
+  ::RevertToSelf ( );
+  SetCurrent ( 0 );
+}
+
+/**
+  Returns the context the calling thread
+  impersonates, or NULL
+*/
+ServerContext * ImpersonationScope::Current ( )
+{
+  DWORD slot = Slot ( m_tls_ctxt, false );
+  if ( slot == TLS_OUT_OF_INDEXES )
+    return 0;
+  return (ServerContext*)TlsGetValue ( slot );
+}
+
+ULONG ImpersonationScope::Switches ( )
+{
+  return m_switches;
+}
+
+ULONG ImpersonationScope::Avoided ( )
+{
+  return m_avoided;
+}
+
+/**
+  Called by ServerContext after each switch
+*/
+void ImpersonationScope::SetCurrent ( ServerContext * ctxt )
+{
+  InterlockedIncrement ( &m_switches );
+  DWORD cslot = Slot ( m_tls_ctxt, ctxt != 0 );
+  DWORD sslot = Slot ( m_tls_serial, ctxt != 0 );
+  // without slots, there's no record to keep: we 
+  // just won't skip any switches
+  if ( cslot == TLS_OUT_OF_INDEXES || sslot == TLS_OUT_OF_INDEXES )
+    return;
+  TlsSetValue ( cslot, ctxt );
+  TlsSetValue ( sslot, (LPVOID)(ULONG_PTR)((ctxt != 0) ? ctxt->Serial ( ) : 0) );
+}
+
+/**
+  Is the calling thread impersonating this 
+  incarnation of ctxt?
+*/
+bool ImpersonationScope::IsCurrent ( const ServerContext * ctxt )
+{
+  if ( Current ( ) != ctxt )
+    return false;
+  DWORD slot = Slot ( m_tls_serial, false );
+  return slot != TLS_OUT_OF_INDEXES
+      && (ULONG)(ULONG_PTR)TlsGetValue ( slot ) == ctxt->Serial ( );
+}
+
+/**
+  Returns the TLS index stored in slot, allocating
+  it first if alloc is set. Done lazily, so it doesn't
+  depend on the order static objects are initialized in.
+*/
+DWORD ImpersonationScope::Slot ( volatile LONG & slot, bool alloc )
+{
+  DWORD index = (DWORD)slot;
+  if ( index != TLS_OUT_OF_INDEXES || !alloc )
+    return index;
+  index = TlsAlloc ( );
+  if ( index == TLS_OUT_OF_INDEXES )
+    return index;
+  LONG prev = InterlockedCompareExchange ( 
+                    &slot, (LONG)index, (LONG)TLS_OUT_OF_INDEXES 
+                  );
+  if ( prev != (LONG)TLS_OUT_OF_INDEXES )
+  {
+    // somebody beat us to it
+    TlsFree ( index );
+    index = (DWORD)prev;
+  }
+  return index;
+}
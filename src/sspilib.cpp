@@ -92,3 +92,30 @@ SspiLib & SspiLib::Instance ( )
   m_instance->AddRef ( );
   return *m_instance;
 }
+
+/**
+  Returns the milliseconds left until ts, an expiration
+  reported by the provider: 0 if it's past, INFINITE if
+  it never comes (or not within 49 days). Providers that
+  don't expire things report 0, which is INFINITE too.
+*/
+DWORD SspiBase::TimeLeft ( const TimeStamp & ts )
+{
+  if ( ts.QuadPart == 0 )
+    return INFINITE;
+  // providers report expirations in local time
+  FILETIME utc, local;
+  GetSystemTimeAsFileTime ( &utc );
+  FileTimeToLocalFileTime ( &utc, &local );
+  ULARGE_INTEGER now;
+  now.LowPart  = local.dwLowDateTime;
+  now.HighPart = local.dwHighDateTime;
+
+  if ( ts.QuadPart <= (LONGLONG)now.QuadPart )
+    return 0;
+  // in 100ns units
+  ULONGLONG left = ((ULONGLONG)ts.QuadPart - now.QuadPart) / 10000;
+  if ( left >= INFINITE )
+    return INFINITE;
+  return (DWORD)left;
+}
@@ -0,0 +1,253 @@
+//==============================================================================
+// File: 			    sspimem.cpp
+//
+// Description: 	implementation of our buffer memory accounting class
+//
+//==============================================================================
+// Copyright(C) 2000, Tomas Restrepo. All rights reserved
+// Send comments to: tomasr@mvps.org
+//==============================================================================
+
+#include "stdafx.h"
+
+using namespace WSSPI2;
+
+// static objects
+using namespace Winterdom::Runtime;
+volatile long BufferStats::m_count[BufferSnapshot::num_owners][BufferSnapshot::num_types];
+volatile LONGLONG BufferStats::m_bytes[BufferSnapshot::num_owners][BufferSnapshot::num_types];
+bool BufferStats::m_exit_report = true;
+BufferStats::sspi_registry * volatile BufferStats::m_registry = 0;
+
+namespace WSSPI2 {
+  /**
+    Dumps the live bo_sspi buffers when the
+    process exits. The registry is never destroyed,
+    so it's still there by then.
+  */
+  class BufferStatsReporter
+  {
+  public:
+    ~BufferStatsReporter ( )
+    {
+      BufferStats::ExitReport ( );
+    }
+  };
+}
+
+namespace {
+  BufferStatsReporter g_reporter;
+
+  const TCHAR * OWNER_NAMES[] = {
+    _T("bo_sspi"), _T("bo_user"), _T("bo_lib")
+  };
+  const TCHAR * TYPE_NAMES[] = {
+    _T("bt_empty"), _T("bt_data"), _T("bt_token"), _T("bt_pkg_params"),
+    _T("bt_missing"), _T("bt_extra"), _T("bt_stream_trailer"), 
+    _T("bt_stream_header"), _T("bt_negotiation_info"), _T("bt_padding"),
+    _T("bt_stream"), _T("bt_mechlist"), _T("bt_ml_signature"),
+    _T("bt_confirmation"), _T("other")
+  };
+}
+
+//==============================================================================
+// BufferSnapshot implementation
+
+BufferSnapshot::BufferSnapshot ( )
+{
+  memset ( m_owner, 0, sizeof(m_owner) );
+  memset ( m_type, 0, sizeof(m_type) );
+}
+
+/**
+  Returns the live buffers held by the given owner
+*/
+const BufferUsage & BufferSnapshot::ByOwner ( buffer_owner owner ) const
+{
+  assert ( owner >= 0 && owner < num_owners );
+  return m_owner[owner];
+}
+
+/**
+  Returns the live buffers of the given type
+*/
+const BufferUsage & BufferSnapshot::ByType ( buffer_type type ) const
+{
+  return m_type[TypeIndex ( type )];
+}
+
+/**
+  Maps a buffer_type into our type slots. Attribute
+  flags (such as SECBUFFER_READONLY) are ignored.
+*/
+int BufferSnapshot::TypeIndex ( buffer_type type )
+{
+  ULONG t = ((ULONG)type) & ~SECBUFFER_ATTRMASK;
+  if ( t <= SECBUFFER_MECHLIST_SIGNATURE )
+    return (int)t;
+  if ( t == bt_confirmation || t == bt_token_confirmation )
+    return num_types - 2;
+  return num_types - 1;
+}
+
+// == dumper ==
+wsostream & WSSPI2::operator<< ( wsostream & o, const BufferSnapshot & s )
+{
+  int i;
+  o << _T("Live buffers by owner:") << std::endl;
+  for ( i = 0; i < BufferSnapshot::num_owners; i++ )
+  {
+    const BufferUsage & u = s.ByOwner ( (buffer_owner)i );
+    o << _T("  ") << OWNER_NAMES[i] << _T(": ") << std::dec << u.count 
+      << _T(" buffers, ") << u.bytes << _T(" bytes") << std::endl;
+  }
+  o << _T("Live buffers by type:") << std::endl;
+  for ( i = 0; i < BufferSnapshot::num_types; i++ )
+  {
+    const BufferUsage & u = s.m_type[i];
+    if ( u.count == 0 ) 
+      continue;
+    o << _T("  ") << TYPE_NAMES[i] << _T(": ") << std::dec << u.count 
+      << _T(" buffers, ") << u.bytes << _T(" bytes") << std::endl;
+  }
+  return o;
+}
+
+//==============================================================================
+// BufferStats implementation
+
+/**
+  Takes a snapshot of the live buffers. The counters
+  are read without locking, so the snapshot may be 
+  slightly skewed if other threads are busy.
+*/
+void BufferStats::Snapshot ( BufferSnapshot & snap )
+{
+  memset ( snap.m_owner, 0, sizeof(snap.m_owner) );
+  memset ( snap.m_type, 0, sizeof(snap.m_type) );
+  for ( int o = 0; o < BufferSnapshot::num_owners; o++ )
+  {
+    for ( int t = 0; t < BufferSnapshot::num_types; t++ )
+    {
+      long count = m_count[o][t];
+      // no torn reads on 32 bit
+      LONGLONG bytes = ::InterlockedExchangeAdd64 ( &m_bytes[o][t], 0 );
+      snap.m_owner[o].count += count;
+      snap.m_owner[o].bytes += bytes;
+      snap.m_type[t].count  += count;
+      snap.m_type[t].bytes  += bytes;
+    }
+  }
+}
+
+/**
+  Lists the live provider owned (bo_sspi) buffers.
+  Returns how many there are.
+*/
+size_t BufferStats::ReportSspi ( wsostream & o )
+{
+  sspi_registry & r = Registry ( );
+  Threading::CriticalSectionLock autolock(r.lock);
+  sbmap::const_iterator it;
+  for ( it = r.buffers.begin ( ); it != r.buffers.end ( ); ++it )
+  {
+    o << _T("bo_sspi buffer at 0x") << std::hex << (ULONG_PTR)(*it).first
+      << _T(", ") << std::dec << (*it).second.size << _T(" bytes, ")
+      << TYPE_NAMES[BufferSnapshot::TypeIndex ( (*it).second.type )] 
+      << std::endl;
+  }
+  return r.buffers.size ( );
+}
+
+/**
+  Enables or disables the report of live bo_sspi buffers
+  at process exit (enabled by default).
+*/
+void BufferStats::SetExitReport ( bool enable )
+{
+  m_exit_report = enable;
+}
+
+/**
+  Accounts for a buffer that was just attached to a Buffer
+*/
+void BufferStats::Add ( 
+        buffer_owner owner, buffer_type type, 
+        DWORD size, const void * mem 
+      )
+{
+  if ( owner == bo_user )
+    return;
+  int t = BufferSnapshot::TypeIndex ( type );
+  ::InterlockedIncrement ( &m_count[owner][t] );
+  ::InterlockedExchangeAdd64 ( &m_bytes[owner][t], (LONGLONG)size );
+  if ( owner == bo_sspi )
+  {
+    sspi_registry & r = Registry ( );
+    Threading::CriticalSectionLock autolock(r.lock);
+    sspi_buf & b = r.buffers[mem];
+    b.type = type;
+    b.size = size;
+  }
+}
+
+/**
+  Accounts for a buffer that was just detached from a Buffer.
+  The arguments must match those used in Add().
+*/
+void BufferStats::Remove ( 
+        buffer_owner owner, buffer_type type, 
+        DWORD size, const void * mem 
+      )
+{
+  if ( owner == bo_user )
+    return;
+  int t = BufferSnapshot::TypeIndex ( type );
+  ::InterlockedDecrement ( &m_count[owner][t] );
+  ::InterlockedExchangeAdd64 ( &m_bytes[owner][t], -(LONGLONG)size );
+  if ( owner == bo_sspi )
+  {
+    sspi_registry & r = Registry ( );
+    Threading::CriticalSectionLock autolock(r.lock);
+    r.buffers.erase ( mem );
+  }
+}
+
+/**
+  Returns the bo_sspi registry, creating it if 
+  this is the first time around. It's never deleted,
+  since Buffers can outlive any static object.
+*/
+BufferStats::sspi_registry & BufferStats::Registry ( )
+{
+  sspi_registry * r = m_registry;
+  if ( r == 0 )
+  {
+    r = new sspi_registry;
+    sspi_registry * prev = (sspi_registry*)InterlockedCompareExchangePointer ( 
+                                  (PVOID volatile*)&m_registry, r, 0 
+                                );
+    if ( prev != 0 )
+    {
+      // somebody beat us to it
+      delete r;
+      r = prev;
+    }
+  }
+  return *r;
+}
+
+/**
+  Sends the list of live bo_sspi buffers to the debugger
+*/
+void BufferStats::ExitReport ( )
+{
+  if ( !m_exit_report || m_registry == 0 || m_registry->buffers.empty ( ) )
+    return;
+
+  std::basic_ostringstream<TCHAR> o;
+  o << _T("WSSPI: provider owned buffers still alive at exit:") << std::endl;
+  size_t n = ReportSspi ( o );
+  o << _T("WSSPI: ") << std::dec << n << _T(" buffer(s) never released") << std::endl;
+  OutputDebugString ( o.str ( ).c_str ( ) );
+}
@@ -114,6 +114,16 @@ wsstring SecPkg::Name ( ) const
     throwex ( err_no_pkg );
   return wsstring(m_info.Name);
 }
+/**
+  Returns the package name without copying it. 
+  The pointer is valid as long as this SecPkg is.
+*/
+const TCHAR * SecPkg::NameStr ( ) const
+{
+  if ( !IsValid ( ) )
+    throwex ( err_no_pkg );
+  return m_info.Name;
+}
 /**
   Returns the package comment
 */
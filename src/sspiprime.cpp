@@ -0,0 +1,289 @@
+//==============================================================================
+// File: 			    sspiprime.cpp
+//
+// Description: 	implementation of our pool of primed client contexts
+//
+//==============================================================================
+// Copyright(C) 2000, Tomas Restrepo. All rights reserved
+// Send comments to: tomasr@mvps.org
+//==============================================================================
+
+#include "stdafx.h"
+
+// needs exceptions, see sspiex.h
+#ifndef WSSPI_NO_EXCEPTIONS
+
+using namespace WSSPI2;
+using namespace Winterdom::Runtime;
+
+/**
+  Creates a pool that will keep up to depth primed
+  contexts for cred, each valid for max_age milliseconds.
+  The pool starts empty; call Fill() to prime it.
+*/
+ClientTokenPool::ClientTokenPool ( 
+      Credentials & cred, 
+      size_t depth, 
+      DWORD max_age /*= 60000*/ 
+    )
+  : m_cred ( cred ),
+    m_depth ( depth ),
+    m_max_age ( max_age ),
+    m_ctxt_reqs ( 0 ),
+    m_data_rep ( 0 ),
+    m_have_params ( false ),
+    m_confirm_mode ( cm_round_trip ),
+    m_hits ( 0 ),
+    m_misses ( 0 ),
+    m_generation ( 0 ),
+    m_pending ( 0 )
+{
+  assert ( cred.IsValid ( ) );
+}
+
+ClientTokenPool::~ClientTokenPool ( )
+{
+  Clear ( );
+}
+
+// == configuration of the contexts we create ==
+/**
+  Working parameters for the contexts we prime
+  (see Context::SetWorkingParams()). Entries already in
+  the pool are discarded.
+*/
+void ClientTokenPool::SetWorkingParams ( ULONG ctxt_reqs, ULONG data_rep )
+{
+  pdeque entries;
+  {
+    Threading::CriticalSectionLock autolock(m_lock);
+    m_ctxt_reqs   = ctxt_reqs;
+    m_data_rep    = data_rep;
+    m_have_params = true;
+    m_generation++;
+    entries.swap ( m_entries );
+  }
+  for ( pdeque::iterator it = entries.begin ( ); it != entries.end ( ); ++it )
+    Release ( *it );
+}
+
+/**
+  Confirmation mode for the contexts we prime
+  (see Context::SetConfirmMode()). Entries already in 
+  the pool are discarded.
+*/
+void ClientTokenPool::SetConfirmMode ( confirm_mode mode )
+{
+  pdeque entries;
+  {
+    Threading::CriticalSectionLock autolock(m_lock);
+    m_confirm_mode = mode;
+    m_generation++;
+    entries.swap ( m_entries );
+  }
+  for ( pdeque::iterator it = entries.begin ( ); it != entries.end ( ); ++it )
+    Release ( *it );
+}
+
+// == pool management ==
+/**
+  Drops expired entries, and primes new contexts until
+  the pool holds depth of them. The provider is called
+  without holding the pool lock, so Acquire() is never
+  blocked by it; the slots being primed are reserved, so
+  other Fill() calls don't prime them too.
+*/
+void ClientTokenPool::Fill ( )
+{
+  pdeque expired;
+  size_t needed = 0;
+  {
+    Threading::CriticalSectionLock autolock(m_lock);
+    DWORD now = GetTickCount ( );
+    while ( !m_entries.empty ( ) && IsExpired ( m_entries.front ( ), now ) )
+    {
+      expired.push_back ( m_entries.front ( ) );
+      m_entries.pop_front ( );
+    }
+    size_t have = m_entries.size ( ) + m_pending;
+    if ( have < m_depth )
+      needed = m_depth - have;
+    m_pending += needed;
+  }
+  for ( pdeque::iterator it = expired.begin ( ); it != expired.end ( ); ++it )
+    Release ( *it );
+
+  for ( size_t i = 0; i < needed; i++ )
+  {
+    entry e = { 0 };
+    try {
+      e = Prime ( );
+    } catch ( ... ) {
+      // give back what we didn't fill
+      Threading::CriticalSectionLock autolock(m_lock);
+      m_pending -= needed - i;
+      throw;
+    }
+    bool stale = false;
+    {
+      Threading::CriticalSectionLock autolock(m_lock);
+      m_pending--;
+      stale = (e.generation != m_generation);
+      if ( !stale )
+        m_entries.push_back ( e );
+    }
+    if ( stale )
+      Release ( e );
+  }
+}
+
+/**
+  Returns a context that's already gone through its first
+  authentication leg, and copies the token to send to the
+  server into token. Continue with Context::Authenticate()
+  as usual when the server replies.
+
+  If there's no fresh entry in the pool, the first leg is
+  done right now. Either way, you own the returned 
+  context and must delete it. The token is handed over 
+  as is, without copying it.
+*/
+ClientContext * ClientTokenPool::Acquire ( Buffer & token )
+{
+  pdeque expired;
+  entry e = { 0 };
+  {
+    Threading::CriticalSectionLock autolock(m_lock);
+    DWORD now = GetTickCount ( );
+    while ( !m_entries.empty ( ) )
+    {
+      entry front = m_entries.front ( );
+      m_entries.pop_front ( );
+      if ( !IsExpired ( front, now ) )
+      {
+        e = front;
+        break;
+      }
+      expired.push_back ( front );
+    }
+  }
+  for ( pdeque::iterator it = expired.begin ( ); it != expired.end ( ); ++it )
+    Release ( *it );
+
+  if ( e.ctxt != 0 )
+  {
+    ::InterlockedIncrement ( &m_hits );
+  }
+  else
+  {
+    ::InterlockedIncrement ( &m_misses );
+    e = Prime ( );
+  }
+
+  token.Swap ( *e.token );
+  delete e.token;
+  return e.ctxt;
+}
+
+/**
+  Discards all entries in the pool, along with
+  those still being primed
+*/
+void ClientTokenPool::Clear ( )
+{
+  pdeque entries;
+  {
+    Threading::CriticalSectionLock autolock(m_lock);
+    m_generation++;
+    entries.swap ( m_entries );
+  }
+  for ( pdeque::iterator it = entries.begin ( ); it != entries.end ( ); ++it )
+    Release ( *it );
+}
+
+// == statistics ==
+/**
+  Returns the number of entries in the pool, 
+  including expired ones not yet discarded.
+*/
+size_t ClientTokenPool::Size ( ) const
+{
+  Threading::CriticalSectionLock autolock(m_lock);
+  return m_entries.size ( );
+}
+
+/**
+  Returns the number of calls to Acquire() served 
+  from the pool
+*/
+ULONG ClientTokenPool::Hits ( ) const
+{
+  return m_hits;
+}
+
+/**
+  Returns the number of calls to Acquire() that had
+  to prime a context on the spot
+*/
+ULONG ClientTokenPool::Misses ( ) const
+{
+  return m_misses;
+}
+
+/**
+  Creates a new context and runs its first leg
+*/
+ClientTokenPool::entry ClientTokenPool::Prime ( )
+{
+  ULONG        ctxt_reqs, data_rep;
+  bool         have_params;
+  confirm_mode mode;
+  entry e;
+  {
+    Threading::CriticalSectionLock autolock(m_lock);
+    ctxt_reqs    = m_ctxt_reqs;
+    data_rep     = m_data_rep;
+    have_params  = m_have_params;
+    mode         = m_confirm_mode;
+    e.generation = m_generation;
+  }
+
+  // allocate in here so a throwing new can't leak the other one
+  e.ctxt  = 0;
+  e.token = 0;
+  try {
+    e.ctxt  = new ClientContext;
+    e.token = new Buffer;
+    e.ctxt->SetCredentials ( m_cred );
+    if ( have_params )
+      e.ctxt->SetWorkingParams ( ctxt_reqs, data_rep );
+    e.ctxt->SetConfirmMode ( mode );
+    e.ctxt->Authenticate ( NULL, e.token );
+  } catch ( ... ) {
+    Release ( e );
+    throw;
+  }
+  e.created = GetTickCount ( );
+  return e;
+}
+
+/**
+  Releases a pool entry
+*/
+void ClientTokenPool::Release ( entry & e )
+{
+  delete e.ctxt;
+  delete e.token;
+  e.ctxt  = 0;
+  e.token = 0;
+}
+
+/**
+  Is the entry too old to be handed out?
+*/
+bool ClientTokenPool::IsExpired ( const entry & e, DWORD now ) const
+{
+  return ((now - e.created) >= m_max_age);
+}
+
+#endif // WSSPI_NO_EXCEPTIONS
@@ -0,0 +1,245 @@
+//==============================================================================
+// File: 			    sspireap.cpp
+//
+// Description: 	implementation of our half-open handshake reaper
+//
+//==============================================================================
+// Copyright(C) 2000, Tomas Restrepo. All rights reserved
+// Send comments to: tomasr@mvps.org
+//==============================================================================
+
+#include "stdafx.h"
+
+using namespace WSSPI2;
+using namespace Winterdom::Runtime;
+
+
+/**
+  Creates the reaper. leg_timeout is the longest a peer
+  gets to answer (ms), tick the granularity of the wheel.
+  max_handshakes and max_bytes are the caps enforced by
+  Register() and End().
+*/
+HandshakeReaper::HandshakeReaper ( 
+      DWORD leg_timeout, 
+      ULONG max_handshakes, 
+      ULONG max_bytes, 
+      DWORD tick /*= 100*/ 
+    )
+  : m_leg_timeout ( leg_timeout ),
+    m_max_handshakes ( max_handshakes ),
+    m_max_bytes ( max_bytes ),
+    m_tick ( tick ),
+    m_last ( 0 ),
+    m_last_ms ( GetTickCount ( ) ),
+    m_in_flight ( 0 ),
+    m_bytes ( 0 ),
+    m_reaped ( 0 )
+{
+  assert ( tick > 0 );
+  // the wheel spans a whole timeout, so an entry
+  // is always due the first time we get to its slot
+  m_slots.resize ( leg_timeout / tick + 2, 0 );
+}
+
+/**
+  All handles must have been Unregister()ed by now;
+  they belong to their owners, not to the reaper.
+*/
+HandshakeReaper::~HandshakeReaper ( )
+{
+  assert ( m_in_flight == 0 );
+}
+
+/**
+  Starts tracking ctxt, which holds bytes of tokens.
+  Returns NULL if that would go over a cap.
+*/
+HandshakeReaper::handle HandshakeReaper::Register ( 
+      Context * ctxt, 
+      ULONG bytes /*= 0*/ 
+    )
+{
+  assert ( ctxt != 0 );
+  Threading::CriticalSectionLock autolock(m_lock);
+  // m_bytes can be over the cap (see End()), so
+  // mind the unsigned arithmetic
+  if ( m_in_flight >= m_max_handshakes 
+       || bytes > m_max_bytes || m_bytes > m_max_bytes - bytes )
+    return 0;
+
+  entry * e = new entry;
+  if ( e == 0 ) throwex ( err_no_memory );
+  e->ctxt   = ctxt;
+  e->bytes  = bytes;
+  e->armed  = false;
+  e->reaped = false;
+  m_in_flight++;
+  m_bytes += bytes;
+  Arm ( e, GetTickCount ( ), m_leg_timeout );
+  return e;
+}
+
+/**
+  Marks the handshake busy, so it can't be reaped
+  during a provider call. Returns false if it has
+  already been reaped.
+*/
+bool HandshakeReaper::Begin ( handle h )
+{
+  assert ( h != 0 );
+  Threading::CriticalSectionLock autolock(m_lock);
+  if ( h->reaped )
+    return false;
+  Disarm ( h );
+  return true;
+}
+
+/**
+  Marks the end of a provider call, and starts the
+  clock for the peer's answer. bytes replaces the 
+  amount held. Going over the byte cap doesn't reap the
+  handshake right away; it gets a deadline of now.
+*/
+void HandshakeReaper::End ( handle h, ULONG bytes )
+{
+  assert ( h != 0 );
+  Threading::CriticalSectionLock autolock(m_lock);
+  if ( h->reaped )
+    return;
+  m_bytes = m_bytes - h->bytes + bytes;
+  h->bytes = bytes;
+
+  Arm ( h, GetTickCount ( ), (m_bytes > m_max_bytes) ? 0 : m_leg_timeout );
+}
+
+/**
+  Stops tracking the handshake. The context
+  is left alone; this releases the handle.
+*/
+void HandshakeReaper::Unregister ( handle h )
+{
+  assert ( h != 0 );
+  Threading::CriticalSectionLock autolock(m_lock);
+  if ( !h->reaped )
+  {
+    Disarm ( h );
+    m_in_flight--;
+    m_bytes -= h->bytes;
+  }
+  delete h;
+}
+
+/**
+  Frees the contexts of all handshakes past their
+  deadline. Returns how many were reaped.
+*/
+ULONG HandshakeReaper::Tick ( )
+{
+  Threading::CriticalSectionLock autolock(m_lock);
+  DWORD now = GetTickCount ( );
+  DWORD elapsed = (DWORD)(now - m_last_ms) / m_tick;
+  size_t count = elapsed;
+  if ( count > m_slots.size ( ) )
+    count = m_slots.size ( );
+
+  // take the entries out of the slots that came due
+  entry * due = 0;
+  for ( size_t t = 1; t <= count; t++ )
+  {
+    entry *& head = m_slots[(size_t)((m_last + t) % m_slots.size ( ))];
+    while ( head != 0 )
+    {
+      entry * e = head;
+      Disarm ( e );
+      e->next = due;
+      due = e;
+    }
+  }
+  m_last    += elapsed;
+  m_last_ms += elapsed * m_tick;
+
+  ULONG reaped = 0;
+  while ( due != 0 )
+  {
+    entry * e = due;
+    due = e->next;
+    DWORD age = (DWORD)(now - e->start);
+    if ( age < e->timeout )
+    {
+      // after a long pause, the slot can hold 
+      // entries armed since; put them back
+      Arm ( e, now, e->timeout - age );
+      continue;
+    }
+    e->reaped = true;
+    e->ctxt->Free ( );
+    m_in_flight--;
+    m_bytes -= e->bytes;
+    e->bytes = 0;
+    reaped++;
+  }
+  m_reaped += reaped;
+  return reaped;
+}
+
+ULONG HandshakeReaper::InFlight ( ) const
+{
+  Threading::CriticalSectionLock autolock(m_lock);
+  return m_in_flight;
+}
+
+ULONG HandshakeReaper::Bytes ( ) const
+{
+  Threading::CriticalSectionLock autolock(m_lock);
+  return m_bytes;
+}
+
+ULONG HandshakeReaper::Reaped ( ) const
+{
+  Threading::CriticalSectionLock autolock(m_lock);
+  return m_reaped;
+}
+
+/**
+  Links e into the slot for timeout ms from now
+*/
+void HandshakeReaper::Arm ( entry * e, DWORD now, DWORD timeout )
+{
+  Disarm ( e );
+  e->start   = now;
+  e->timeout = timeout;
+  // count from the current slot, rounding up, so we 
+  // never get there early; the wheel is wide enough
+  // for a whole leg timeout
+  size_t ahead = ((DWORD)(now - m_last_ms) + timeout + m_tick - 1) / m_tick;
+  if ( ahead == 0 )
+    ahead = 1;
+  if ( ahead >= m_slots.size ( ) )
+    ahead = m_slots.size ( ) - 1;
+  e->slot = (size_t)((m_last + ahead) % m_slots.size ( ));
+  entry *& head = m_slots[e->slot];
+  e->prev = 0;
+  e->next = head;
+  if ( head != 0 )
+    head->prev = e;
+  head = e;
+  e->armed = true;
+}
+
+/**
+  Unlinks e from its slot, if it's in one
+*/
+void HandshakeReaper::Disarm ( entry * e )
+{
+  if ( !e->armed )
+    return;
+  if ( e->prev != 0 )
+    e->prev->next = e->next;
+  else
+    m_slots[e->slot] = e->next;
+  if ( e->next != 0 )
+    e->next->prev = e->prev;
+  e->armed = false;
+}
+
@@ -0,0 +1,156 @@
+//==============================================================================
+// File: 			    sspireg.cpp
+//
+// Description: 	implementation of our server credentials registry
+//
+//==============================================================================
+// Copyright(C) 2000, Tomas Restrepo. All rights reserved
+// Send comments to: tomasr@mvps.org
+//==============================================================================
+
+#include "stdafx.h"
+
+// needs exceptions, see sspiex.h
+#ifndef WSSPI_NO_EXCEPTIONS
+
+using namespace WSSPI2;
+using namespace Winterdom::Runtime;
+
+
+CredentialsRegistry::CredentialsRegistry ( )
+  : m_table ( 0 ),
+    m_epoch ( 0 )
+{
+  m_readers[0] = 0;
+  m_readers[1] = 0;
+  m_table = new crmap;
+  if ( m_table == 0 ) throwex ( err_no_memory );
+}
+
+/**
+  No lookups may be in progress by now
+*/
+CredentialsRegistry::~CredentialsRegistry ( )
+{
+  delete m_table;
+}
+
+/**
+  Returns the credentials published for target, or
+  an invalid reference if there are none. Never blocks.
+*/
+CredentialsRef CredentialsRegistry::Find ( const wsstring & target ) const
+{
+  long epoch;
+  const crmap * table = Enter ( epoch );
+  CredentialsRef cred;
+  crmap::const_iterator it = table->find ( target );
+  if ( it != table->end ( ) )
+    cred = it->second;
+  Leave ( epoch );
+  return cred;
+}
+
+/**
+  Returns the number of targets published
+*/
+size_t CredentialsRegistry::Size ( ) const
+{
+  long epoch;
+  const crmap * table = Enter ( epoch );
+  size_t size = table->size ( );
+  Leave ( epoch );
+  return size;
+}
+
+/**
+  Adds the credentials for target, or replaces
+  them (on key rollover, say)
+*/
+void CredentialsRegistry::Publish ( 
+      const wsstring & target, 
+      const CredentialsRef & cred 
+    )
+{
+  assert ( cred.IsValid ( ) );
+  Threading::CriticalSectionLock autolock(m_write_lock);
+  crmap * next = new crmap ( *m_table );
+  if ( next == 0 ) throwex ( err_no_memory );
+  (*next)[target] = cred;
+  Swap ( next );
+}
+
+/**
+  Stops serving target
+*/
+void CredentialsRegistry::Retire ( const wsstring & target )
+{
+  Threading::CriticalSectionLock autolock(m_write_lock);
+  if ( m_table->find ( target ) == m_table->end ( ) )
+    return;
+  crmap * next = new crmap ( *m_table );
+  if ( next == 0 ) throwex ( err_no_memory );
+  next->erase ( target );
+  Swap ( next );
+}
+
+/**
+  Replaces the whole set at once, so lookups see
+  either the old set or the new one, never a mix
+*/
+void CredentialsRegistry::Replace ( const crmap & creds )
+{
+  Threading::CriticalSectionLock autolock(m_write_lock);
+  crmap * next = new crmap ( creds );
+  if ( next == 0 ) throwex ( err_no_memory );
+  Swap ( next );
+}
+
+/**
+  Announces a lookup, and returns the table it
+  may use until Leave(). If a writer flips the epoch
+  while we announce ourselves, we try again, so that
+  the writer's wait covers us.
+*/
+const CredentialsRegistry::crmap * CredentialsRegistry::Enter ( long & epoch ) const
+{
+  for ( ;; )
+  {
+    epoch = m_epoch;
+    InterlockedIncrement ( &m_readers[epoch & 1] );
+    if ( epoch == m_epoch )
+      return m_table;
+    InterlockedDecrement ( &m_readers[epoch & 1] );
+  }
+}
+
+void CredentialsRegistry::Leave ( long epoch ) const
+{
+  InterlockedDecrement ( &m_readers[epoch & 1] );
+}
+
+/**
+  Publishes next and deletes the old table once no
+  lookup can see it. Called with the write lock held.
+*/
+void CredentialsRegistry::Swap ( crmap * next )
+{
+  crmap * old = (crmap*)InterlockedExchangePointer ( (PVOID volatile*)&m_table, next );
+  Synchronize ( );
+  delete old;
+}
+
+/**
+  Waits until all lookups that may have seen the old
+  table are done. New lookups announce themselves under
+  the new epoch, and find the new table; those that
+  raced with the flip notice it in Enter() and retry.
+*/
+void CredentialsRegistry::Synchronize ( )
+{
+  long old = InterlockedIncrement ( &m_epoch ) - 1;
+  while ( m_readers[old & 1] != 0 )
+    Sleep ( 0 );
+}
+
+#endif // WSSPI_NO_EXCEPTIONS
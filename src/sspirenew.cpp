@@ -0,0 +1,132 @@
+//==============================================================================
+// File: 			    sspirenew.cpp
+//
+// Description: 	implementation of our context renewal scheduler
+//
+//==============================================================================
+// Copyright(C) 2000, Tomas Restrepo. All rights reserved
+// Send comments to: tomasr@mvps.org
+//==============================================================================
+
+#include "stdafx.h"
+
+using namespace WSSPI2;
+using namespace Winterdom::Runtime;
+
+
+/**
+  Creates the scheduler. Contexts are handed to 
+  handler lead milliseconds before they expire.
+*/
+RenewalScheduler::RenewalScheduler ( 
+      RenewalHandler & handler, 
+      DWORD lead /*= 300000*/ 
+    )
+  : m_handler ( handler ),
+    m_lead ( lead ),
+    m_last_tick ( GetTickCount ( ) ),
+    m_clock ( 0 )
+{
+}
+
+/**
+  Starts watching an established context, or 
+  reschedules it after a renewal. Contexts that
+  never expire aren't tracked.
+*/
+void RenewalScheduler::Track ( Context * ctxt )
+{
+  assert ( ctxt != 0 );
+  assert ( ctxt->IsValid ( ) );
+  DWORD left = ctxt->TimeToExpiry ( );
+
+  Threading::CriticalSectionLock autolock(m_lock);
+  rctxts::iterator it = m_ctxts.find ( ctxt );
+  if ( it != m_ctxts.end ( ) )
+  {
+    m_due.erase ( it->second );
+    m_ctxts.erase ( it );
+  }
+  if ( left == INFINITE )
+    return;
+
+  ULONGLONG due = Now ( );
+  if ( left > m_lead )
+    due += left - m_lead;
+  m_ctxts[ctxt] = m_due.insert ( rdue::value_type ( due, ctxt ) );
+}
+
+/**
+  Stops watching ctxt. Call it before 
+  freeing or deleting a tracked context.
+*/
+void RenewalScheduler::Untrack ( Context * ctxt )
+{
+  Threading::CriticalSectionLock autolock(m_lock);
+  rctxts::iterator it = m_ctxts.find ( ctxt );
+  if ( it != m_ctxts.end ( ) )
+  {
+    m_due.erase ( it->second );
+    m_ctxts.erase ( it );
+  }
+}
+
+/**
+  Hands every context that's due to the handler,
+  and stops tracking it. Returns how many.
+*/
+ULONG RenewalScheduler::Poll ( )
+{
+  std::vector<Context*> due;
+  {
+    Threading::CriticalSectionLock autolock(m_lock);
+    ULONGLONG now = Now ( );
+    while ( !m_due.empty ( ) && m_due.begin ( )->first <= now )
+    {
+      Context * ctxt = m_due.begin ( )->second;
+      m_due.erase ( m_due.begin ( ) );
+      m_ctxts.erase ( ctxt );
+      due.push_back ( ctxt );
+    }
+  }
+  for ( size_t i = 0; i < due.size ( ); i++ )
+    m_handler.OnRenewalDue ( due[i] );
+  return due.size ( );
+}
+
+/**
+  Returns the milliseconds until the next
+  context is due, INFINITE if none is tracked
+*/
+DWORD RenewalScheduler::NextDue ( ) const
+{
+  Threading::CriticalSectionLock autolock(m_lock);
+  if ( m_due.empty ( ) )
+    return INFINITE;
+  ULONGLONG now = Now ( );
+  ULONGLONG next = m_due.begin ( )->first;
+  if ( next <= now )
+    return 0;
+  if ( next - now >= INFINITE )
+    return INFINITE - 1;
+  return (DWORD)(next - now);
+}
+
+size_t RenewalScheduler::Size ( ) const
+{
+  Threading::CriticalSectionLock autolock(m_lock);
+  return m_ctxts.size ( );
+}
+
+/**
+  Milliseconds since we were created. GetTickCount()
+  wraps every 49 days, which long lived contexts can
+  easily outlast. Called with the lock held.
+*/
+ULONGLONG RenewalScheduler::Now ( ) const
+{
+  DWORD tick = GetTickCount ( );
+  m_clock += (DWORD)(tick - m_last_tick);
+  m_last_tick = tick;
+  return m_clock;
+}
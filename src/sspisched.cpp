@@ -0,0 +1,240 @@
+//==============================================================================
+// File: 			    sspisched.cpp
+//
+// Description: 	implementation of our handshake scheduler
+//
+//==============================================================================
+// Copyright(C) 2000, Tomas Restrepo. All rights reserved
+// Send comments to: tomasr@mvps.org
+//==============================================================================
+
+#include "stdafx.h"
+#include <process.h>
+
+using namespace WSSPI2;
+using namespace Winterdom::Runtime;
+
+
+/**
+  Starts threads workers. rate and burst are
+  in handshakes (per second, for rate).
+*/
+HandshakeScheduler::HandshakeScheduler ( 
+      ULONG threads, 
+      ULONG max_backlog, 
+      ULONG rate, 
+      ULONG burst 
+    )
+  : m_max_backlog ( max_backlog ),
+    m_rate ( rate ),
+    m_burst ( burst ),
+    m_stop ( false )
+{
+  assert ( threads > 0 );
+  assert ( burst > 0 );
+  memset ( &m_stats, 0, sizeof(m_stats) );
+  m_overflow.tokens = m_burst * 1000;
+  m_overflow.last   = GetTickCount ( );
+  if ( !m_work.Create ( 0, 0x7FFFFFFF ) )
+    throwexe ( err_io_failed, HRESULT_FROM_WIN32(GetLastError ( )) );
+
+  for ( ULONG i = 0; i < threads; i++ )
+  {
+    unsigned id = 0;
+    HANDLE h = (HANDLE)_beginthreadex ( NULL, 0, WorkerProc, this, 0, &id );
+    if ( h == 0 )
+    {
+      DWORD error = GetLastError ( );
+      StopWorkers ( );
+      throwexe ( err_io_failed, HRESULT_FROM_WIN32(error) );
+    }
+    m_threads.push_back ( h );
+  }
+}
+
+/**
+  Stops the workers. Tasks still queued are
+  run first, since their owners are waiting
+  for them.
+*/
+HandshakeScheduler::~HandshakeScheduler ( )
+{
+  StopWorkers ( );
+}
+
+/**
+  Asks the workers to quit once the 
+  queues are empty, and waits for them
+*/
+void HandshakeScheduler::StopWorkers ( )
+{
+  {
+    Threading::CriticalSectionLock autolock(m_lock);
+    m_stop = true;
+  }
+  size_t i;
+  for ( i = 0; i < m_threads.size ( ); i++ )
+    m_work.Release ( );
+  for ( i = 0; i < m_threads.size ( ); i++ )
+  {
+    WaitForSingleObject ( m_threads[i], INFINITE );
+    CloseHandle ( m_threads[i] );
+  }
+  m_threads.clear ( );
+}
+
+/**
+  Decides whether a new handshake from source
+  may start. Cheap enough to call per accept().
+*/
+bool HandshakeScheduler::Admit ( ULONG source )
+{
+  DWORD now = GetTickCount ( );
+  Threading::CriticalSectionLock autolock(m_lock);
+  if ( m_handshakes.size ( ) >= m_max_backlog )
+  {
+    m_stats.shed_queue++;
+    return false;
+  }
+
+  bucket * b = 0;
+  bmap::iterator it = m_sources.find ( source );
+  if ( it != m_sources.end ( ) )
+  {
+    b = &it->second;
+  }
+  else
+  {
+    if ( m_sources.size ( ) >= max_sources )
+      Prune ( now );
+    if ( m_sources.size ( ) >= max_sources )
+    {
+      // table's full of active sources
+      b = &m_overflow;
+    }
+    else
+    {
+      bucket nb;
+      nb.tokens = m_burst * 1000;
+      nb.last   = now;
+      it = m_sources.insert ( bmap::value_type ( source, nb ) ).first;
+      b = &it->second;
+    }
+  }
+  if ( !Take ( *b, now ) )
+  {
+    m_stats.shed_rate++;
+    return false;
+  }
+  m_stats.admitted++;
+  return true;
+}
+
+/**
+  Queues a task by its priority
+*/
+void HandshakeScheduler::Post ( Task * task )
+{
+  assert ( task != 0 );
+  {
+    Threading::CriticalSectionLock autolock(m_lock);
+    if ( task->DataPlane ( ) )
+    {
+      m_data.push_back ( task );
+    }
+    else
+    {
+      m_handshakes.push_back ( task );
+      if ( m_handshakes.size ( ) > m_stats.peak_handshakes )
+        m_stats.peak_handshakes = m_handshakes.size ( );
+    }
+  }
+  m_work.Release ( );
+}
+
+/**
+  Returns the current counters
+*/
+SchedulerStats HandshakeScheduler::Stats ( ) const
+{
+  Threading::CriticalSectionLock autolock(m_lock);
+  SchedulerStats stats = m_stats;
+  stats.queued_data       = m_data.size ( );
+  stats.queued_handshakes = m_handshakes.size ( );
+  return stats;
+}
+
+unsigned __stdcall HandshakeScheduler::WorkerProc ( void * param )
+{
+  static_cast<HandshakeScheduler*>(param)->Worker ( );
+  return 0;
+}
+
+/**
+  Worker loop: data plane first, then handshakes
+*/
+void HandshakeScheduler::Worker ( )
+{
+  for ( ;; )
+  {
+    m_work.Acquire ( );
+    Task * task = 0;
+    {
+      Threading::CriticalSectionLock autolock(m_lock);
+      if ( !m_data.empty ( ) )
+      {
+        task = m_data.front ( );
+        m_data.pop_front ( );
+        m_stats.ran_data++;
+      }
+      else if ( !m_handshakes.empty ( ) )
+      {
+        task = m_handshakes.front ( );
+        m_handshakes.pop_front ( );
+        m_stats.ran_handshakes++;
+      }
+      else if ( m_stop )
+      {
+        return;
+      }
+    }
+    if ( task != 0 )
+      task->Run ( );
+  }
+}
+
+/**
+  Refills a bucket and takes a token from it
+*/
+bool HandshakeScheduler::Take ( bucket & b, DWORD now )
+{
+  ULONG cap = m_burst * 1000;
+  DWORD elapsed = now - b.last;
+  b.last = now;
+  // elapsed ms * handshakes/s = thousandths of a token
+  if ( m_rate != 0 && elapsed >= (cap / m_rate) )
+    b.tokens = cap;
+  else if ( (b.tokens += elapsed * m_rate) > cap )
+    b.tokens = cap;
+
+  if ( b.tokens < 1000 )
+    return false;
+  b.tokens -= 1000;
+  return true;
+}
+
+/**
+  Forgets sources idle long enough to have 
+  refilled anyway. Called with the lock held.
+*/
+void HandshakeScheduler::Prune ( DWORD now )
+{
+  bmap::iterator it = m_sources.begin ( );
+  while ( it != m_sources.end ( ) )
+  {
+    if ( (now - it->second.last) >= source_idle )
+      m_sources.erase ( it++ );
+    else
+      ++it;
+  }
+}
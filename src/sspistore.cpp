@@ -0,0 +1,436 @@
+//==============================================================================
+// File: 			    sspistore.cpp
+//
+// Description: 	implementation of our persistent session store
+//
+//==============================================================================
+// Copyright(C) 2000, Tomas Restrepo. All rights reserved
+// Send comments to: tomasr@mvps.org
+//==============================================================================
+
+#include "stdafx.h"
+
+// needs exceptions, see sspiex.h
+#ifndef WSSPI_NO_EXCEPTIONS
+
+using namespace WSSPI2;
+using namespace Winterdom::Runtime;
+
+namespace {
+  const DWORD STORE_MAGIC   = 0x31535357; // "WSS1"
+  const DWORD STORE_VERSION = 1;
+  const DWORD RECORD_MAGIC  = 0x52535357; // "WSSR"
+  //! sessions per ImportAll() task
+  const size_t IMPORT_BATCH = 64;
+}
+
+namespace WSSPI2 {
+  /**
+    Imports a batch of sessions. The last
+    task to finish signals the waiter.
+  */
+  struct SessionStore::import_task : public Task
+  {
+    const BYTE *       blobs;
+    Credentials *      cred;
+    SessionHandler *   handler;
+    const import_entry * entries;
+    size_t             count;
+    long *             pending;
+    long *             restored;
+    Threading::Event * done;
+
+    //! counts the task as done, however it leaves Run()
+    struct done_guard {
+      import_task * t;
+      ~done_guard ( )
+      {
+        if ( InterlockedDecrement ( t->pending ) == 0 )
+          t->done->Release ( );
+      }
+    };
+
+    void Run ( )
+    {
+      done_guard guard = { this };
+      for ( size_t i = 0; i < count; i++ )
+        Restore ( entries[i] );
+    }
+
+    //! imports a session; never throws
+    void Restore ( const import_entry & e )
+    {
+      ServerContext * ctxt = 0;
+      DWORD error = 0;
+      try {
+        ctxt = new ServerContext;
+        ctxt->SetCredentials ( *cred );
+        Buffer blob;
+        blob.FromByteStream ( (BYTE*)blobs + e.offset, e.size, bt_token );
+        ctxt->Import ( blob );
+#ifndef WSSPI_EX_THROW_NEW
+      } catch ( SspiEx & ex ) {
+        error = ex.Win32Err ( );
+      }
+#else
+      } catch ( SspiEx * ex ) {
+        error = ex->Win32Err ( );
+        ex->Free ( );
+      }
+#endif
+      catch ( ... ) {
+        // std::bad_alloc
+        error = ERROR_NOT_ENOUGH_MEMORY;
+      }
+
+      // a throwing handler only loses its own session
+      try {
+        if ( error == 0 )
+        {
+          handler->OnSessionRestored ( e.id, ctxt );
+          InterlockedIncrement ( restored );
+        }
+        else
+        {
+          delete ctxt;
+          handler->OnSessionFailed ( e.id, error );
+        }
+      } catch ( ... ) {
+      }
+    }
+  };
+} // namespace WSSPI2
+
+
+/**
+  Opens the store at path, creating it (with room
+  for initial_size bytes) if it doesn't exist.
+*/
+SessionStore::SessionStore ( 
+      const TCHAR * path, 
+      DWORD initial_size /*= 0x100000*/ 
+    )
+  : m_file ( INVALID_HANDLE_VALUE ),
+    m_mapping ( NULL ),
+    m_view ( 0 ),
+    m_size ( 0 )
+{
+  assert ( path != 0 );
+  m_file = CreateFile ( 
+              path, GENERIC_READ | GENERIC_WRITE, 0, NULL, 
+              OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL 
+            );
+  if ( m_file == INVALID_HANDLE_VALUE )
+    throwexe ( err_io_failed, HRESULT_FROM_WIN32(GetLastError ( )) );
+
+  LARGE_INTEGER size;
+  if ( !GetFileSizeEx ( m_file, &size ) )
+    size.QuadPart = 0;
+  DWORD map_size = (DWORD)size.QuadPart;
+  if ( map_size < initial_size )
+    map_size = initial_size;
+  if ( map_size < sizeof(file_header) )
+    map_size = sizeof(file_header);
+
+  try {
+    Map ( map_size );
+  } catch ( ... ) {
+    CloseHandle ( m_file );
+    throw;
+  }
+
+  file_header * h = (file_header*)m_view;
+  if ( h->magic != STORE_MAGIC || h->version != STORE_VERSION 
+       || h->used < sizeof(file_header) || h->used > m_size )
+  {
+    // new, or not one of ours: start afresh
+    h->magic    = STORE_MAGIC;
+    h->version  = STORE_VERSION;
+    h->used     = sizeof(file_header);
+    h->reserved = 0;
+  }
+  Index ( );
+}
+
+SessionStore::~SessionStore ( )
+{
+  Unmap ( );
+  CloseHandle ( m_file );
+}
+
+/**
+  Exports ctxt and stores it as session id, 
+  replacing whatever was stored for it
+*/
+void SessionStore::Save ( ULONGLONG id, Context & ctxt )
+{
+  Buffer blob;
+  ctxt.Export ( blob );
+
+  Threading::CriticalSectionLock autolock(m_lock);
+  DWORD need = RecordSize ( blob.Size ( ) );
+  if ( need < blob.Size ( ) )
+    throwex ( err_no_memory );
+  file_header * h = (file_header*)m_view;
+  if ( need > m_size - h->used )
+  {
+    // the file can't go past 4GB
+    DWORD size = m_size;
+    while ( need > size - h->used )
+    {
+      if ( size > 0x7FFFFFFF )
+        throwex ( err_no_memory );
+      size *= 2;
+    }
+    // on failure, we keep serving what we have
+    Map ( size );
+    h = (file_header*)m_view;
+  }
+
+  DWORD offset = h->used;
+  record * r = At ( offset );
+  r->magic    = RECORD_MAGIC;
+  r->live     = 0;
+  r->id       = id;
+  r->size     = blob.Size ( );
+  r->reserved = 0;
+  memcpy ( r + 1, blob.ByteStream ( ), blob.Size ( ) );
+  // the record only counts once it's complete
+  r->live = 1;
+  h->used += need;
+
+  sindex::iterator it = m_index.find ( id );
+  if ( it != m_index.end ( ) )
+  {
+    At ( it->second )->live = 0;
+    it->second = offset;
+  }
+  else
+  {
+    m_index[id] = offset;
+  }
+}
+
+/**
+  Imports session id into ctxt, which must have its
+  credentials set. Returns false if there's no such 
+  session.
+*/
+bool SessionStore::Load ( ULONGLONG id, Context & ctxt )
+{
+  Threading::CriticalSectionLock autolock(m_lock);
+  sindex::iterator it = m_index.find ( id );
+  if ( it == m_index.end ( ) )
+    return false;
+  record * r = At ( it->second );
+  Buffer blob;
+  blob.FromByteStream ( (BYTE*)(r + 1), r->size, bt_token );
+  ctxt.Import ( blob );
+  return true;
+}
+
+/**
+  Forgets session id
+*/
+void SessionStore::Remove ( ULONGLONG id )
+{
+  Threading::CriticalSectionLock autolock(m_lock);
+  sindex::iterator it = m_index.find ( id );
+  if ( it != m_index.end ( ) )
+  {
+    At ( it->second )->live = 0;
+    m_index.erase ( it );
+  }
+}
+
+/**
+  Imports every stored session into a new ServerContext
+  using cred, and hands it to handler. Batches of 
+  sessions run on exec (or right here if it's NULL); the
+  call returns once they're all done. The sessions are
+  copied out first, so the store isn't locked while the
+  handler runs. Returns how many sessions were restored.
+*/
+ULONG SessionStore::ImportAll ( 
+      Credentials & cred, 
+      SessionHandler & handler, 
+      Executor * exec /*= 0*/ 
+    )
+{
+  InlineExecutor inline_exec;
+  if ( exec == 0 )
+    exec = &inline_exec;
+
+  std::vector<import_entry> entries;
+  std::vector<BYTE> blobs;
+  {
+    Threading::CriticalSectionLock autolock(m_lock);
+    entries.reserve ( m_index.size ( ) );
+    sindex::iterator it;
+    for ( it = m_index.begin ( ); it != m_index.end ( ); ++it )
+    {
+      const record * r = At ( it->second );
+      const BYTE * blob = (const BYTE*)(r + 1);
+      import_entry e = { r->id, (DWORD)blobs.size ( ), r->size };
+      entries.push_back ( e );
+      blobs.insert ( blobs.end ( ), blob, blob + r->size );
+    }
+  }
+  if ( entries.empty ( ) )
+    return 0;
+
+  size_t batches = (entries.size ( ) + IMPORT_BATCH - 1) / IMPORT_BATCH;
+  std::vector<import_task> tasks ( batches );
+  long pending  = batches;
+  long restored = 0;
+  Threading::Event done;
+  if ( !done.Create ( ) )
+    throwexe ( err_io_failed, HRESULT_FROM_WIN32(GetLastError ( )) );
+
+  for ( size_t i = 0; i < batches; i++ )
+  {
+    import_task & t = tasks[i];
+    t.blobs    = blobs.empty ( ) ? 0 : &blobs[0];
+    t.cred     = &cred;
+    t.handler  = &handler;
+    t.entries  = &entries[i * IMPORT_BATCH];
+    t.count    = (i + 1 < batches) ? IMPORT_BATCH 
+                                   : entries.size ( ) - i * IMPORT_BATCH;
+    t.pending  = &pending;
+    t.restored = &restored;
+    t.done     = &done;
+  }
+  size_t posted = 0;
+  try {
+    for ( ; posted < batches; posted++ )
+      exec->Post ( &tasks[posted] );
+  } catch ( ... ) {
+    // the tasks posted still use our locals, so wait for
+    // them; the others won't run, so don't wait for those
+    long unposted = (long)(batches - posted);
+    if ( InterlockedExchangeAdd ( &pending, -unposted ) != unposted )
+      done.Acquire ( );
+    throw;
+  }
+  done.Acquire ( );
+  return restored;
+}
+
+/**
+  Moves the live records to the front of the
+  file, dropping the dead ones. This is done in place,
+  so a crash halfway through corrupts the store; see
+  the class notes.
+*/
+void SessionStore::Compact ( )
+{
+  Threading::CriticalSectionLock autolock(m_lock);
+  file_header * h = (file_header*)m_view;
+  DWORD from = sizeof(file_header);
+  DWORD to   = sizeof(file_header);
+  while ( from < h->used )
+  {
+    record * r = At ( from );
+    DWORD size = RecordSize ( r->size );
+    if ( r->live )
+    {
+      if ( from != to )
+      {
+        memmove ( m_view + to, r, size );
+        m_index[At ( to )->id] = to;
+      }
+      to += size;
+    }
+    from += size;
+  }
+  h->used = to;
+}
+
+/**
+  Writes the store out to disk
+*/
+void SessionStore::Flush ( )
+{
+  Threading::CriticalSectionLock autolock(m_lock);
+  FlushViewOfFile ( m_view, ((file_header*)m_view)->used );
+}
+
+/**
+  Returns the number of sessions stored
+*/
+size_t SessionStore::Size ( ) const
+{
+  Threading::CriticalSectionLock autolock(m_lock);
+  return m_index.size ( );
+}
+
+/**
+  Maps size bytes of the file, growing it if needed.
+  The new view is set up before the old one goes, so
+  if this fails, the store is left as it was.
+*/
+void SessionStore::Map ( DWORD size )
+{
+  HANDLE mapping = CreateFileMapping ( m_file, NULL, PAGE_READWRITE, 0, size, NULL );
+  if ( mapping == NULL )
+    throwexe ( err_io_failed, HRESULT_FROM_WIN32(GetLastError ( )) );
+  BYTE * view = (BYTE*)MapViewOfFile ( mapping, FILE_MAP_WRITE, 0, 0, size );
+  if ( view == 0 )
+  {
+    DWORD error = GetLastError ( );
+    CloseHandle ( mapping );
+    throwexe ( err_io_failed, HRESULT_FROM_WIN32(error) );
+  }
+  Unmap ( );
+  m_mapping = mapping;
+  m_view    = view;
+  m_size    = size;
+}
+
+void SessionStore::Unmap ( )
+{
+  if ( m_view != 0 )
+    UnmapViewOfFile ( m_view );
+  if ( m_mapping != NULL )
+    CloseHandle ( m_mapping );
+  m_view    = 0;
+  m_mapping = NULL;
+  m_size    = 0;
+}
+
+/**
+  Rebuilds the index from the file. A torn record at the
+  end (say, from a crash during Save()) ends the scan.
+*/
+void SessionStore::Index ( )
+{
+  m_index.clear ( );
+  file_header * h = (file_header*)m_view;
+  DWORD offset = sizeof(file_header);
+  while ( offset + sizeof(record) <= h->used )
+  {
+    record * r = At ( offset );
+    if ( r->magic != RECORD_MAGIC || r->size > h->used - offset - sizeof(record) )
+      break;
+    if ( r->live )
+      m_index[r->id] = offset;
+    offset += RecordSize ( r->size );
+  }
+  h->used = offset;
+}
+
+SessionStore::record * SessionStore::At ( DWORD offset ) const
+{
+  return (record*)(m_view + offset);
+}
+
+/**
+  Bytes taken by a record holding a blob
+  of the given size, kept 8 byte aligned
+*/
+DWORD SessionStore::RecordSize ( DWORD blob )
+{
+  return (sizeof(record) + blob + 7) & ~7;
+}
+
+#endif // WSSPI_NO_EXCEPTIONS
@@ -0,0 +1,240 @@
+//==============================================================================
+// File: 			    sspitok.cpp
+//
+// Description: 	implementation of our token size tracking class
+//
+//==============================================================================
+// Copyright(C) 2000, Tomas Restrepo. All rights reserved
+// Send comments to: tomasr@mvps.org
+//==============================================================================
+
+#include "stdafx.h"
+
+using namespace WSSPI2;
+
+/**
+  What we know about a package/side. Sizes are kept 
+  as a moving average plus a moving mean deviation of
+  the tokens seen in each leg, in 1/16ths of a byte, 
+  the way TCP estimates round trip times. Newer tokens
+  weigh more, so the hint follows the tokens down
+  again after an odd large one, unlike a running max.
+
+  Updates are interlocked adds of the computed step, 
+  without any lock: two threads racing just both nudge
+  the estimate, which is fine for a hint.
+*/
+namespace WSSPI2 {
+struct TokenStats {
+  struct leg_size {
+    volatile LONG avg;
+    volatile LONG dev;
+    volatile LONG samples;
+  };
+  leg_size      sizes[TokenSizes::max_legs];
+  //! handshakes by leg count (index 0 is unused)
+  volatile LONG legs[HandshakeLegs::max_legs+1];
+};
+} // namespace WSSPI2
+
+namespace {
+  // hints are rounded up to this granularity
+  const ULONG TOKEN_GRANULARITY = 256;
+  // estimates are kept in 1/(1 << TOKEN_SCALE) bytes
+  const int   TOKEN_SCALE = 4;
+  // gain of the average and of the deviation, as shifts
+  const int   AVG_GAIN = 3;   // 1/8
+  const int   DEV_GAIN = 2;   // 1/4
+  // how many deviations above the average the hint goes
+  const int   DEV_SPAN = 4;
+
+  // package/side key for our map
+  wsstring SideKey ( const wsstring & pkg, bool server )
+  {
+    wsstring key = pkg;
+    key += server ? _T('S') : _T('C');
+    return key;
+  }
+}
+
+// static objects
+using namespace Winterdom::Runtime;
+Threading::CriticalSection TokenSizes::m_lock;
+TokenSizes::tsmap TokenSizes::m_stats;
+
+
+/**
+  Returns the statistics record for a package and 
+  side, creating it if needed. Records are never 
+  freed, so the pointer can be kept for good.
+*/
+TokenStats * TokenSizes::Find ( const TCHAR * pkg, bool server )
+{
+  assert ( pkg != 0 );
+  return Lookup ( pkg, server, true );
+}
+
+/**
+  Returns the buffer size we should use for the
+  output token of the given leg. If we haven't 
+  seen that leg yet, it returns max_token.
+
+  The hint sits a few deviations above the average
+  of the recent tokens, so an undersized buffer should
+  be rare. Callers still need to handle 
+  SEC_E_BUFFER_TOO_SMALL.
+*/
+ULONG TokenSizes::Hint ( TokenStats * stats, ULONG leg, ULONG max_token )
+{
+  if ( stats == 0 )
+    return max_token;
+  if ( leg >= max_legs )
+    leg = max_legs - 1;
+  const TokenStats::leg_size & s = stats->sizes[leg];
+  if ( s.samples == 0 )
+    return max_token;
+
+  LONG avg = s.avg;
+  LONG dev = s.dev;
+  if ( avg < 0 ) avg = 0;
+  if ( dev < 0 ) dev = 0;
+  ULONG size = (ULONG)((avg + DEV_SPAN * dev) >> TOKEN_SCALE);
+  size = ((size + TOKEN_GRANULARITY - 1) / TOKEN_GRANULARITY) * TOKEN_GRANULARITY;
+  return (size < max_token) ? size : max_token;
+}
+
+/**
+  Records the size of a token produced in the given leg.
+*/
+void TokenSizes::Record ( TokenStats * stats, ULONG leg, ULONG size )
+{
+  if ( stats == 0 || size == 0 )
+    return;
+  if ( leg >= max_legs )
+    leg = max_legs - 1;
+  TokenStats::leg_size & s = stats->sizes[leg];
+  LONG scaled = (LONG)size << TOKEN_SCALE;
+  if ( InterlockedIncrement ( &s.samples ) == 1 )
+  {
+    // first one: start with some slack
+    InterlockedExchange ( &s.avg, scaled );
+    InterlockedExchange ( &s.dev, scaled / 4 );
+    return;
+  }
+  LONG error = scaled - s.avg;
+  InterlockedExchangeAdd ( &s.avg, error >> AVG_GAIN );
+  if ( error < 0 )
+    error = -error;
+  InterlockedExchangeAdd ( &s.dev, (error - s.dev) >> DEV_GAIN );
+}
+
+/**
+  Same as above, looking the package up first
+*/
+ULONG TokenSizes::Hint ( 
+        const wsstring & pkg, bool server, 
+        ULONG leg, ULONG max_token 
+      )
+{
+  return Hint ( Lookup ( pkg, server, false ), leg, max_token );
+}
+
+/**
+  Same as above, looking the package up first
+*/
+void TokenSizes::Record ( 
+        const wsstring & pkg, bool server, 
+        ULONG leg, ULONG size 
+      )
+{
+  if ( size != 0 )
+    Record ( Lookup ( pkg, server, true ), leg, size );
+}
+
+/**
+  Forgets all the observed sizes. Useful if the 
+  environment changed (e.g. group membership grew and
+  with it the size of Kerberos tickets).
+*/
+void TokenSizes::Reset ( )
+{
+  Threading::CriticalSectionLock autolock(m_lock);
+  tsmap::iterator it;
+  for ( it = m_stats.begin ( ); it != m_stats.end ( ); ++it )
+  {
+    for ( int i = 0; i < max_legs; i++ )
+      InterlockedExchange ( &(*it).second->sizes[i].samples, 0 );
+  }
+}
+
+/**
+  Finds the record for a package/side, optionally
+  creating it
+*/
+TokenStats * TokenSizes::Lookup ( const wsstring & pkg, bool server, bool create )
+{
+  wsstring key = SideKey ( pkg, server );
+  Threading::CriticalSectionLock autolock(m_lock);
+  tsmap::iterator it = m_stats.find ( key );
+  if ( it != m_stats.end ( ) )
+    return (*it).second;
+  if ( !create )
+    return 0;
+
+  TokenStats * stats = new TokenStats;
+  memset ( stats, 0, sizeof(TokenStats) );
+  m_stats.insert ( tsmap::value_type ( key, stats ) );
+  return stats;
+}
+
+
+//==============================================================================
+// HandshakeLegs implementation
+
+/**
+  Records a completed (successful or denied) 
+  handshake that took the given number of legs.
+*/
+void HandshakeLegs::Record ( TokenStats * stats, ULONG legs )
+{
+  if ( stats == 0 || legs == 0 )
+    return;
+  if ( legs > max_legs )
+    legs = max_legs;
+  InterlockedIncrement ( &stats->legs[legs] );
+}
+
+/**
+  Same as above, looking the package up first
+*/
+void HandshakeLegs::Record ( const wsstring & pkg, bool server, ULONG legs )
+{
+  if ( legs != 0 )
+    Record ( TokenSizes::Lookup ( pkg, server, true ), legs );
+}
+
+/**
+  Returns how many handshakes took exactly legs legs
+  (or max_legs and more, if legs == max_legs).
+*/
+ULONG HandshakeLegs::Count ( const wsstring & pkg, bool server, ULONG legs )
+{
+  if ( legs == 0 || legs > max_legs )
+    return 0;
+  TokenStats * stats = TokenSizes::Lookup ( pkg, server, false );
+  return (stats != 0) ? (ULONG)stats->legs[legs] : 0;
+}
+
+/**
+  Clears all the counters
+*/
+void HandshakeLegs::Reset ( )
+{
+  Threading::CriticalSectionLock autolock(TokenSizes::m_lock);
+  TokenSizes::tsmap::iterator it;
+  for ( it = TokenSizes::m_stats.begin ( ); it != TokenSizes::m_stats.end ( ); ++it )
+  {
+    for ( int i = 0; i <= max_legs; i++ )
+      InterlockedExchange ( &(*it).second->legs[i], 0 );
+  }
+}